@@ -1,13 +1,20 @@
 #include <Application.h>
+#include <algorithm>
+#include <chrono>
 #include <util/log.h>
 
 #include <memory/Bus.h>
 #include <cpu/cpu_core.h>
+#include <cpu/cpu_precompile.h>
+#include <cpu/cpu_speculate.h>
+#include <cpu/cpu_profile.h>
 
 #define MODULE "Application"
 
 CPU* cpu;
 
+constexpr int cycles_per_frame = 33868800 / 60;
+
 bool Application::Init(std::string bios_path)
 {
 	log("Initializing emulator\n");
@@ -15,11 +22,69 @@ bool Application::Init(std::string bios_path)
 	Bus::Bus(bios_path);
 	cpu = new CPU();
 
+	if (!Profile::path.empty())
+		Profile::Load(max_block_instrs);
+	if (Precompile::enabled)
+		Precompile::Run(max_block_instrs);
+	if (Speculate::enabled)
+		Speculate::Start(max_block_instrs);
+
 	return true;
 }
 
-void Application::Run()
+void Application::Run(const RunLimits& limits)
 {
-	while (1)
-		cpu->Clock(32);
+	using clock = std::chrono::steady_clock;
+
+	auto start = clock::now();
+	uint64_t start_cycles = g_state.cycles, start_instrs = g_state.cycles - g_state.stalls;
+	CPURecompiler::Stats start_stats = Bus::recomp->stats;
+
+	// A frame limit is just a cycle limit in frames
+	uint64_t max_cycles = limits.cycles;
+	if (limits.frames && (!max_cycles || limits.frames * cycles_per_frame < max_cycles))
+		max_cycles = limits.frames * cycles_per_frame;
+
+	const char* reason = nullptr;
+	while (!reason)
+	{
+		uint64_t cycles = g_state.cycles - start_cycles;
+		uint64_t instrs = g_state.cycles - g_state.stalls - start_instrs;
+
+		// Blocks only stop at the deadline once they finish, so every limit can
+		// be overshot by up to a block. Instructions never outnumber cycles, so
+		// what's left of the instruction budget can be run as cycles
+		uint64_t budget = cycles_per_frame;
+		if (max_cycles)
+			budget = std::min(budget, max_cycles - cycles);
+		if (limits.instrs)
+			budget = std::min(budget, limits.instrs - instrs);
+
+		cpu->Clock(budget);
+
+		cycles = g_state.cycles - start_cycles;
+		instrs = g_state.cycles - g_state.stalls - start_instrs;
+
+		if (limits.instrs && instrs >= limits.instrs)
+			reason = "instruction limit";
+		else if (max_cycles && cycles >= max_cycles)
+			reason = max_cycles == limits.cycles ? "cycle limit" : "frame limit";
+		else if (limits.seconds && std::chrono::duration<double>(clock::now() - start).count() >= limits.seconds)
+			reason = "time limit";
+	}
+
+	double seconds = std::chrono::duration<double>(clock::now() - start).count();
+	uint64_t cycles = g_state.cycles - start_cycles;
+	uint64_t instrs = g_state.cycles - g_state.stalls - start_instrs;
+	uint64_t lookups = Bus::recomp->stats.lookups - start_stats.lookups;
+	uint64_t hits = Bus::recomp->stats.hits - start_stats.hits;
+
+	log("Stopped at the %s, pc 0x%08x\n", reason, g_state.pc);
+	log("%llu instructions, %llu cycles, %.2f frames in %.3fs\n", (unsigned long long)instrs, (unsigned long long)cycles,
+		(double)cycles / cycles_per_frame, seconds);
+	log("%.2f guest MIPS, %llu blocks compiled, %.1f%% lookup hit rate\n", instrs / seconds / 1e6,
+		(unsigned long long)(Bus::recomp->stats.compiled - start_stats.compiled), lookups ? hits * 100.0 / lookups : 0.0);
+
+	// The run ended where it was asked to, so there's nothing to debug
+	dump_on_exit = false;
 }
@@ -3,10 +3,20 @@
 #include <cstdint>
 #include <string>
 
+// Where Application::Run stops. Zero is no limit, and with no limits at all it never returns
+struct RunLimits
+{
+	uint64_t instrs = 0; // Guest instructions retired
+	uint64_t cycles = 0;
+	uint64_t frames = 0;
+	double seconds = 0; // Wall clock, only checked between frames
+};
+
 class Application
 {
 public:
 	static bool Init(std::string bios_path);
 
-	static void Run();
-};
\ No newline at end of file
+	// Prints what was run and how fast when it stops
+	static void Run(const RunLimits& limits = RunLimits());
+};
@@ -0,0 +1,255 @@
+#include <cpu/bios_hle.h>
+#include <cpu/cpu_core.h>
+#include <memory/Bus.h>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#define MODULE "BiosHLE"
+
+// The guest's registers as they'll be once the caller's loads have landed. Nothing
+// is written back until a handler commits to the call in Return
+static uint32_t regs[32];
+
+static bool GetString(uint32_t addr, std::string& str)
+{
+	str.clear();
+
+	for (;;)
+	{
+		uint8_t* c = Bus::GetRAM(addr++, 1);
+		if (!c)
+			return false;
+		if (!*c)
+			return true;
+		str += (char)*c;
+	}
+}
+
+static bool Return(uint32_t value)
+{
+	HandleLoadDelay();
+	HandleLoadDelay();
+
+	g_state.regs[2] = value;
+	g_state.pc = g_state.regs[31];
+	g_state.next_pc = g_state.pc + 4;
+
+	// Stand in for the jr $ra the guest function would have ended with
+	return_stack_top = (return_stack_top - 1) & (return_stack_size - 1);
+	return true;
+}
+
+static bool Memcpy(uint32_t dst, uint32_t src, uint32_t len)
+{
+	uint8_t* d = Bus::GetRAM(dst, len);
+	uint8_t* s = Bus::GetRAM(src, len);
+
+	if (!d || !s)
+		return false;
+
+	// The guest's memcpy copies forwards a byte at a time, which repeats the
+	// source when it overlaps the start of the destination
+	if (d > s && d < s + len)
+	{
+		for (uint32_t i = 0; i < len; i++)
+			d[i] = s[i];
+	}
+	else
+		memcpy(d, s, len);
+
+	Bus::recomp->MarkRangeDirty(Bus::mask_region(dst), len);
+	return Return(dst);
+}
+
+static bool Memset(uint32_t dst, uint8_t value, uint32_t len)
+{
+	uint8_t* d = Bus::GetRAM(dst, len);
+
+	if (!d)
+		return false;
+
+	memset(d, value, len);
+	Bus::recomp->MarkRangeDirty(Bus::mask_region(dst), len);
+	return Return(dst);
+}
+
+static bool Strlen(uint32_t addr)
+{
+	std::string str;
+
+	if (!addr)
+		return Return(0);
+
+	if (!GetString(addr, str))
+		return false;
+
+	return Return(str.size());
+}
+
+static bool Putchar(uint32_t c)
+{
+	putchar(c);
+	return Return(c);
+}
+
+static bool Puts(uint32_t addr)
+{
+	std::string str;
+
+	if (!GetString(addr, str))
+		return false;
+
+	fputs(str.c_str(), stdout);
+	return Return(0);
+}
+
+// Follows the MIPS calling convention: a0-a3, then the caller's stack past the
+// 16 byte register home area
+static bool GetArg(int index, uint32_t& value)
+{
+	if (index < 4)
+	{
+		value = regs[4 + index];
+		return true;
+	}
+
+	uint8_t* p = Bus::GetRAM(regs[29] + index * 4, 4);
+	if (!p)
+		return false;
+
+	memcpy(&value, p, 4);
+	return true;
+}
+
+static bool Printf()
+{
+	std::string fmt, out;
+
+	if (!GetString(regs[4], fmt))
+		return false;
+
+	int arg = 1;
+	for (size_t i = 0; i < fmt.size(); i++)
+	{
+		if (fmt[i] != '%')
+		{
+			out += fmt[i];
+			continue;
+		}
+
+		// Collect flags, width and precision, then hand the spec to the host printf
+		size_t start = i++;
+		while (i < fmt.size() && strchr("-+ #0123456789.lh", fmt[i]))
+			i++;
+		if (i == fmt.size())
+			break;
+
+		std::string spec = fmt.substr(start, i - start);
+		spec.erase(std::remove_if(spec.begin(), spec.end(), [](char c) { return c == 'l' || c == 'h'; }), spec.end());
+
+		char conv = fmt[i];
+		if (conv == '%')
+		{
+			out += '%';
+			continue;
+		}
+
+		uint32_t value;
+		if (!GetArg(arg++, value))
+			return false;
+
+		char buf[256];
+		switch (conv)
+		{
+		case 'd':
+		case 'i':
+			snprintf(buf, sizeof(buf), (spec + 'd').c_str(), (int32_t)value);
+			break;
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'o':
+			snprintf(buf, sizeof(buf), (spec + conv).c_str(), value);
+			break;
+		case 'p':
+			snprintf(buf, sizeof(buf), "%08x", value);
+			break;
+		case 'c':
+			snprintf(buf, sizeof(buf), (spec + 'c').c_str(), (char)value);
+			break;
+		case 's':
+		{
+			std::string str;
+			if (!GetString(value, str))
+				return false;
+			snprintf(buf, sizeof(buf), (spec + 's').c_str(), str.c_str());
+			break;
+		}
+		default:
+			// Unknown conversion, let the guest's printf deal with it
+			return false;
+		}
+
+		out += buf;
+	}
+
+	fputs(out.c_str(), stdout);
+	return Return(out.size());
+}
+
+bool BiosHLE::TryCall()
+{
+	uint32_t vector = Bus::mask_region(g_state.pc);
+
+	if (vector != 0xA0 && vector != 0xB0)
+		return false;
+
+	// Stores with the cache isolated don't reach RAM, so leave those to the guest
+	if ((g_state.cop0[12] >> 16) & 1)
+		return false;
+
+	// Look past any loads still in flight from the caller, without landing them yet
+	uint32_t* r = regs;
+	memcpy(r, g_state.regs, sizeof(regs));
+	r[load_delay_slot.reg] = load_delay_slot.data;
+	r[next_load_delay.reg] = next_load_delay.data;
+	r[0] = 0;
+
+	uint32_t func = r[9];
+
+	switch (vector)
+	{
+	case 0xA0:
+		switch (func)
+		{
+		case 0x1B:
+			return Strlen(r[4]);
+		case 0x28:
+			return Memset(r[4], 0, r[5]); // bzero
+		case 0x2A:
+			return Memcpy(r[4], r[5], r[6]);
+		case 0x2B:
+			return Memset(r[4], r[5], r[6]);
+		case 0x3C:
+			return Putchar(r[4]);
+		case 0x3E:
+			return Puts(r[4]);
+		case 0x3F:
+			return Printf();
+		}
+		break;
+	case 0xB0:
+		switch (func)
+		{
+		case 0x3D:
+			return Putchar(r[4]); // std_out_putchar
+		case 0x3F:
+			return Puts(r[4]); // std_out_puts
+		}
+		break;
+	}
+
+	return false;
+}
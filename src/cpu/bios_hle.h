@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdint>
+
+// High level emulation of the BIOS A0/B0 kernel calls. When enabled,
+// hot library routines run natively on Bus::ram instead of as guest code
+namespace BiosHLE
+{
+	inline bool enabled = false;
+
+	// Called at the start of each block. Returns true if the block was a kernel
+	// call that has been handled, leaving the CPU at the caller's return address
+	bool TryCall();
+};
@@ -1,4 +1,5 @@
 #include "cpu_core.h"
+#include <cpu/bios_hle.h>
 #include <cstring>
 #include <fstream>
 
@@ -6,10 +7,15 @@ CPUState g_state;
 
 void Dump()
 {
+	if (!dump_on_exit)
+		return;
+
 	for (int i = 0; i < 32; i++)
 		printf("%s\t->\t0x%08x\n", GetRegName(i), g_state.regs[i]);
 	printf("pc\t->\t0x%08x\n", g_state.pc);
 	printf("next_pc\t->\t0x%08x\n", g_state.next_pc);
+	printf("hi\t->\t0x%08x\n", g_state.hi);
+	printf("lo\t->\t0x%08x\n", g_state.lo);
 	printf("IsC: %d\n", ((g_state.cop0[12] >> 16) & 1) == 1);
 
 	std::ofstream ram("ram.dump");
@@ -36,27 +42,21 @@ CPU::CPU()
 
 void CPU::Clock(int cycles)
 {
-	uint32_t pc = g_state.pc;
-	uint32_t next_pc = g_state.next_pc;
-	for (int i = 0; i < cycles; i++)
+	// Linked blocks jump straight into each other, so this only sees blocks
+	// that aren't linked yet and the ones that run into the deadline
+	cycle_deadline = g_state.cycles + cycles;
+
+	while (g_state.cycles < cycle_deadline)
 	{
-		uint32_t opcode = Bus::read<uint32_t>(pc);
-		pc = next_pc;
-		next_pc += 4;
-
-		bool shouldContinue = recomp->EmitInstruction(opcode);
-
-		if (!shouldContinue)
-		{
-			// Add one more opcode for branch delay slot
-			opcode = Bus::read<uint32_t>(pc);
-			pc = next_pc;
-			next_pc += 4;
-			recomp->EmitInstruction(opcode);
-			break;
-		}
-	}
+		if (BiosHLE::enabled && BiosHLE::TryCall())
+			continue;
 
-	auto func = recomp->CompileBlock();
-	func();
+		// Only compile blocks that aren't cached yet
+		auto func = recomp->LookupBlock(g_state.pc);
+
+		if (!func)
+			func = recomp->Compile(g_state.pc, max_block_instrs);
+
+		func();
+	}
 }
\ No newline at end of file
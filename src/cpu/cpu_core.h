@@ -4,6 +4,8 @@
 #include <memory/Bus.h>
 #include <cpu/cpu_recomp_core.h>
 
+constexpr int max_block_instrs = 32;
+
 class CPU
 {
 private:
@@ -19,6 +21,10 @@ struct CPUState
 	uint32_t regs[32];
 	uint32_t cop0[32];
 	uint32_t pc, next_pc;
+	uint64_t cycles; // One per instruction retired
+	uint32_t hi, lo;
+	uint64_t mdu_ready; // Cycle the multiply/divide unit's result is ready on
+	uint64_t stalls; // Cycles spent waiting on the MDU, so cycles - stalls is instructions retired
 };
 
 inline const char* GetRegName(int reg)
@@ -96,6 +102,9 @@ inline const char* GetRegName(int reg)
 
 extern CPUState g_state;
 
+// Cleared by runs that stop where they were asked to, which print stats instead
+inline bool dump_on_exit = true;
+
 struct LoadDelaySlot
 {
 	int reg;
@@ -104,9 +113,33 @@ struct LoadDelaySlot
 
 inline LoadDelaySlot load_delay_slot, next_load_delay;
 
+// Generated code chains from block to block until this many cycles have run
+inline uint64_t cycle_deadline;
+
+// A guest PC and the host code to run for it
+struct BlockLink
+{
+	uint32_t pc;
+	HostFunc host;
+};
+
+static_assert(sizeof(BlockLink) == 16);
+
+// Checked by generated code on the way out of a block, keyed by virtual PC.
+// Only holds blocks for the current cache isolation state
+constexpr int jump_cache_size = 4096;
+inline BlockLink jump_cache[jump_cache_size];
+
+// Pushed by jal and jalr, popped by jr $ra
+constexpr int return_stack_size = 16;
+inline BlockLink return_stack[return_stack_size];
+inline uint32_t return_stack_top;
+
 static void HandleLoadDelay()
 {
+	// Loads into $zero still go through the slot, so it has to be put back
 	g_state.regs[load_delay_slot.reg] = load_delay_slot.data;
+	g_state.regs[0] = 0;
 	load_delay_slot = next_load_delay;
 	next_load_delay.reg = 0;
 	next_load_delay.data = 0;
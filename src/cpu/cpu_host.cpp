@@ -0,0 +1,19 @@
+#include <cpu/cpu_host.h>
+#include <util/log.h>
+
+#include <xbyak/xbyak_util.h>
+
+#define MODULE "HostCPU"
+
+void HostCPU::Detect()
+{
+	Xbyak::util::Cpu cpu;
+
+	bmi1 = cpu.has(Xbyak::util::Cpu::tBMI1);
+	bmi2 = cpu.has(Xbyak::util::Cpu::tBMI2);
+	lzcnt = cpu.has(Xbyak::util::Cpu::tLZCNT);
+	avx2 = cpu.has(Xbyak::util::Cpu::tAVX2);
+
+	log("Using%s%s%s%s%s\n", bmi1 ? " BMI1" : "", bmi2 ? " BMI2" : "", lzcnt ? " LZCNT" : "", avx2 ? " AVX2" : "",
+		!bmi1 && !bmi2 && !lzcnt && !avx2 ? " baseline x86-64 only" : "");
+}
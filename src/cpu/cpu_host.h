@@ -0,0 +1,20 @@
+#pragma once
+
+// What the host CPU supports beyond baseline x86-64, checked once at startup.
+// Code generation and helpers use the better instructions when they're there
+namespace HostCPU
+{
+	inline bool bmi1 = false; // andn, tzcnt
+	inline bool bmi2 = false; // shlx, shrx, sarx
+	inline bool lzcnt = false;
+	inline bool avx2 = false;
+
+	void Detect();
+};
+
+// For helpers with an AVX2 version, only called when HostCPU::avx2 is set
+#ifdef _MSC_VER
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
@@ -0,0 +1,257 @@
+#include <cpu/cpu_loop_idiom.h>
+#include <cpu/cpu_core.h>
+#include <cpu/cpu_ops.h>
+#include <cpu/cpu_host.h>
+#include <memory/Bus.h>
+
+#include <cstring>
+#include <immintrin.h>
+
+static int AccessSize(uint32_t opcode)
+{
+	switch (opcode)
+	{
+	case Instructions::lb:
+	case Instructions::lbu:
+	case Instructions::sb:
+		return 1;
+	case Instructions::lh:
+	case Instructions::lhu:
+	case Instructions::sh:
+		return 2;
+	case Instructions::lw:
+	case Instructions::sw:
+		return 4;
+	default:
+		return 0;
+	}
+}
+
+// Fills as many whole 32 byte chunks as fit, and returns how many bytes that was
+TARGET_AVX2 static uint64_t FillWide(uint8_t* dst, uint32_t value, uint64_t len, int size)
+{
+	__m256i v = size == 2 ? _mm256_set1_epi16((int16_t)value) : _mm256_set1_epi32((int32_t)value);
+	uint64_t i = 0;
+
+	for (; i + 32 <= len; i += 32)
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), v);
+
+	return i;
+}
+
+bool LoopIdioms::Detect(const std::vector<uint32_t>& instrs, LoopIdiom& idiom)
+{
+	int n = instrs.size();
+
+	if (n < 3 || n > 16)
+		return false;
+
+	// The block has to end with a bne back to its own start
+	Opcode branch;
+	branch.full = instrs[n - 2];
+	if (branch.opcode != Instructions::bne || (int16_t)branch.i_type.imm != -(n - 1))
+		return false;
+
+	int32_t delta[32] = {};
+	bool modified[32] = {};
+	int load_idx = -1, store_idx = -1;
+	int value_reg = 0, store_size = 0, load_size = 0;
+	int32_t cmp_delta[2] = {};
+
+	memset(&idiom, 0, sizeof(idiom));
+	idiom.length = n;
+
+	for (int i = 0; i < n; i++)
+	{
+		Opcode o;
+		o.full = instrs[i];
+
+		if (o.full == 0)
+			continue;
+
+		if (i == n - 2)
+		{
+			cmp_delta[0] = delta[o.i_type.rs];
+			cmp_delta[1] = delta[o.i_type.rt];
+			continue;
+		}
+
+		switch (o.opcode)
+		{
+		case Instructions::addi:
+		case Instructions::addiu:
+			// Only pointer and counter increments
+			if (o.i_type.rt != o.i_type.rs || o.i_type.rt == 0)
+				return false;
+			delta[o.i_type.rt] += (int16_t)o.i_type.imm;
+			modified[o.i_type.rt] = true;
+			break;
+		case Instructions::lb:
+		case Instructions::lbu:
+		case Instructions::lh:
+		case Instructions::lhu:
+		case Instructions::lw:
+			if (load_idx != -1 || o.i_type.rt == 0)
+				return false;
+			load_idx = i;
+			load_size = AccessSize(o.opcode);
+			idiom.load_op = o.opcode;
+			idiom.load_reg = o.i_type.rt;
+			idiom.src_reg = o.i_type.rs;
+			idiom.src_off = delta[o.i_type.rs] + (int16_t)o.i_type.imm;
+			break;
+		case Instructions::sb:
+		case Instructions::sh:
+		case Instructions::sw:
+			if (store_idx != -1)
+				return false;
+			store_idx = i;
+			store_size = AccessSize(o.opcode);
+			value_reg = o.i_type.rt;
+			idiom.dst_reg = o.i_type.rs;
+			idiom.dst_off = delta[o.i_type.rs] + (int16_t)o.i_type.imm;
+			break;
+		default:
+			return false;
+		}
+	}
+
+	if (store_idx == -1)
+		return false;
+
+	idiom.size = store_size;
+	memcpy(idiom.stride, delta, sizeof(delta));
+
+	if (load_idx != -1)
+	{
+		// The loaded value must have landed by the time it's stored
+		idiom.copy = true;
+		if (value_reg != idiom.load_reg || store_idx < load_idx + 2 || load_size != store_size)
+			return false;
+		if (modified[idiom.load_reg] || idiom.src_reg == idiom.load_reg || delta[idiom.src_reg] != idiom.size)
+			return false;
+	}
+	else
+	{
+		if (modified[value_reg])
+			return false;
+		idiom.fill_reg = value_reg;
+	}
+
+	if (delta[idiom.dst_reg] != idiom.size || (idiom.copy && idiom.dst_reg == idiom.load_reg))
+		return false;
+
+	// One side of the compare counts, the other stays put
+	int a = branch.i_type.rs, b = branch.i_type.rt;
+	int side = 0;
+	if (delta[a] == 0 && !modified[a])
+	{
+		std::swap(a, b);
+		side = 1;
+	}
+
+	if (delta[a] == 0 || modified[b])
+		return false;
+	if (idiom.copy && (a == idiom.load_reg || b == idiom.load_reg))
+		return false;
+
+	idiom.cmp_reg = a;
+	idiom.end_reg = b;
+	idiom.cmp_off = cmp_delta[side];
+
+	return true;
+}
+
+bool LoopIdioms::Run(const LoopIdiom* idiom)
+{
+	// A load from before the loop would land partway through the first iteration
+	if (load_delay_slot.reg)
+		return false;
+
+	uint32_t* regs = g_state.regs;
+
+	// Work out how many iterations it takes for the compare to fail
+	int32_t d = idiom->stride[idiom->cmp_reg];
+	uint32_t cmp = regs[idiom->cmp_reg] + idiom->cmp_off;
+	uint32_t end = regs[idiom->end_reg];
+	uint32_t dist = d > 0 ? end - cmp : cmp - end;
+	uint32_t step = d > 0 ? d : -d;
+
+	if (dist % step)
+		return false;
+
+	uint64_t count = (uint64_t)(dist / step) + 1;
+	uint64_t len = count * idiom->size;
+
+	if (len > sizeof(Bus::ram))
+		return false;
+
+	uint32_t dst_addr = regs[idiom->dst_reg] + idiom->dst_off;
+	uint8_t* dst = Bus::GetRAM(dst_addr, len);
+
+	if (!dst || (dst_addr % idiom->size))
+		return false;
+
+	if (idiom->copy)
+	{
+		uint32_t src_addr = regs[idiom->src_reg] + idiom->src_off;
+		uint8_t* src = Bus::GetRAM(src_addr, len);
+
+		if (!src || (src_addr % idiom->size))
+			return false;
+
+		// Copying forwards repeats the source when it overlaps the start of the destination
+		uint32_t last = 0;
+		if (dst > src && dst < src + len)
+		{
+			for (uint64_t i = 0; i < len; i += idiom->size)
+			{
+				memcpy(&last, src + i, idiom->size);
+				memcpy(dst + i, &last, idiom->size);
+			}
+		}
+		else
+		{
+			memmove(dst, src, len);
+			memcpy(&last, src + len - idiom->size, idiom->size);
+		}
+
+		switch (idiom->load_op)
+		{
+		case Instructions::lb:
+			last = (int32_t)(int8_t)last;
+			break;
+		case Instructions::lh:
+			last = (int32_t)(int16_t)last;
+			break;
+		}
+
+		regs[idiom->load_reg] = last;
+	}
+	else
+	{
+		uint32_t value = regs[idiom->fill_reg];
+
+		if (idiom->size == 1)
+			memset(dst, value, len);
+		else
+		{
+			uint64_t i = HostCPU::avx2 ? FillWide(dst, value, len, idiom->size) : 0;
+			for (; i < len; i += idiom->size)
+				memcpy(dst + i, &value, idiom->size);
+		}
+	}
+
+	Bus::recomp->MarkRangeDirty(Bus::mask_region(dst_addr), len);
+
+	for (int i = 1; i < 32; i++)
+		regs[i] += count * idiom->stride[i];
+
+	g_state.cycles += count * idiom->length;
+
+	// Leave the CPU where the loop falls through
+	g_state.pc += idiom->length * 4;
+	g_state.next_pc = g_state.pc + 4;
+
+	return true;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// A block that branches back to its own start and does nothing but copy or
+// fill memory one element per iteration. Found at compile time, and run as
+// a single bulk operation on Bus::ram when the bounds check out at runtime
+struct LoopIdiom
+{
+	uint32_t length; // Instructions in the loop, including the delay slot
+	uint8_t size; // Element size in bytes
+	bool copy; // Copy from src, otherwise fill with fill_reg
+	uint8_t load_op; // The load used for copies, which decides what's left in load_reg
+	uint8_t src_reg, dst_reg, fill_reg, load_reg;
+	int32_t src_off, dst_off; // Address relative to the base register at the start of an iteration
+
+	// The loop runs while cmp_reg + cmp_off != end_reg
+	uint8_t cmp_reg, end_reg;
+	int32_t cmp_off;
+
+	int32_t stride[32]; // How much each register moves by per iteration
+};
+
+namespace LoopIdioms
+{
+	bool Detect(const std::vector<uint32_t>& instrs, LoopIdiom& idiom);
+
+	// Called from generated code. Returns false if the loop has to run as guest code
+	bool Run(const LoopIdiom* idiom);
+};
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+
 enum Instructions
 {
 	special = 0x00,
@@ -14,10 +16,17 @@ enum Instructions
 	lui = 0x0f,
 	cop0 = 0x10,
 	lb = 0x20,
+	lh = 0x21,
+	lwl = 0x22,
 	lw = 0x23,
+	lbu = 0x24,
+	lhu = 0x25,
+	lwr = 0x26,
 	sb = 0x28,
 	sh = 0x29,
+	swl = 0x2a,
 	sw = 0x2b,
+	swr = 0x2e,
 };
 
 enum Cop0Instructions
@@ -28,9 +37,58 @@ enum Cop0Instructions
 
 enum SpecialInstructions
 {
+	sll = 0x00,
+	srl = 0x02,
+	sra = 0x03,
+	sllv = 0x04,
+	srlv = 0x06,
+	srav = 0x07,
 	jr = 0x08,
+	jalr = 0x09,
+	mfhi = 0x10,
+	mthi = 0x11,
+	mflo = 0x12,
+	mtlo = 0x13,
+	mult = 0x18,
+	multu = 0x19,
+	div_ = 0x1A,
+	divu = 0x1B,
 	addu = 0x21,
 	and_ = 0x24,
 	or_ = 0x25,
 	sltiu = 0x2B,
-};
\ No newline at end of file
+};
+
+struct Opcode
+{
+    union
+    {
+        uint32_t full;
+        struct
+        { /* Used when polling for the opcode */
+            uint32_t : 26;
+            uint32_t opcode : 6;
+        };
+        struct
+        {
+            uint32_t imm : 16;
+            uint32_t rt : 5;
+            uint32_t rs : 5;
+            uint32_t opcode : 6;
+        } i_type;
+        struct
+        {
+            uint32_t target : 26;
+            uint32_t opcode : 6;
+        } j_type;
+        struct
+        {
+            uint32_t func : 6;
+            uint32_t sa : 5;
+            uint32_t rd : 5;
+            uint32_t rt : 5;
+            uint32_t rs : 5;
+            uint32_t opcode : 6;
+        } r_type;
+    };
+};
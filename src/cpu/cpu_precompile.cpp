@@ -0,0 +1,119 @@
+#include <cpu/cpu_precompile.h>
+#include <cpu/cpu_recomp_core.h>
+#include <memory/Bus.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <unordered_set>
+
+#define MODULE "Precompile"
+
+// Walks blocks the same way CPURecompiler::Compile forms them, so the start of
+// every block found matches one the CPU would look up
+std::vector<uint32_t> Precompile::DiscoverBIOS(int max_instrs)
+{
+	std::vector<uint32_t> blocks;
+	std::vector<uint32_t> pending = {0xBFC00000, 0xBFC00180};
+	std::unordered_set<uint32_t> seen;
+
+	while (!pending.empty())
+	{
+		uint32_t start = pending.back();
+		pending.pop_back();
+
+		if (!Bus::IsROM(Bus::mask_region(start)) || !seen.insert(start).second)
+			continue;
+
+		std::vector<uint32_t> successors;
+		uint32_t pc = start;
+		bool supported = true;
+
+		for (int i = 0; i < max_instrs; i++, pc += 4)
+		{
+			// Running off the end of the BIOS counts as something we can't compile
+			if (!Bus::IsROM(Bus::mask_region(pc + 4)))
+			{
+				supported = false;
+				break;
+			}
+
+			Opcode o;
+			o.full = Bus::read<uint32_t>(pc);
+
+			if (!Bus::recomp->IsSupported(o.full))
+			{
+				supported = false;
+				break;
+			}
+
+			if (Bus::recomp->ModifiesPC(o.full))
+			{
+				if (!Bus::recomp->IsSupported(Bus::read<uint32_t>(pc + 4)))
+				{
+					supported = false;
+					break;
+				}
+
+				switch (o.opcode)
+				{
+				case Instructions::j:
+				case Instructions::jal:
+					successors.push_back(((pc + 4) & 0xf0000000) | (o.j_type.target << 2));
+					break;
+				case Instructions::beq:
+				case Instructions::bne:
+					successors.push_back(pc + 4 + ((int32_t)(int16_t)o.i_type.imm << 2));
+					break;
+				}
+
+				// Fall through for conditional branches, the return address for calls
+				if (o.opcode != Instructions::j && !(o.opcode == Instructions::special && o.r_type.func == SpecialInstructions::jr))
+					successors.push_back(pc + 8);
+				pc += 4;
+				break;
+			}
+
+			if (Bus::recomp->EndsBlock(o.full) || i == max_instrs - 1)
+			{
+				successors.push_back(pc + 4);
+				break;
+			}
+		}
+
+		// Blocks with instructions we can't compile are left for the CPU to run into
+		if (!supported)
+			continue;
+
+		blocks.push_back(start);
+		pending.insert(pending.end(), successors.begin(), successors.end());
+	}
+
+	return blocks;
+}
+
+void Precompile::Run(int max_instrs)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	std::vector<uint32_t> blocks = DiscoverBIOS(max_instrs);
+	std::atomic<size_t> next = 0;
+
+	int count = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<std::thread> workers;
+
+	for (int i = 0; i < count; i++)
+	{
+		workers.emplace_back([&]()
+		{
+			for (size_t b = next++; b < blocks.size(); b = next++)
+				Bus::recomp->Compile(blocks[b], max_instrs);
+		});
+	}
+
+	for (auto& w : workers)
+		w.join();
+
+	auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+	log("Compiled %zu BIOS blocks on %d threads in %ldms\n", blocks.size(), count, (long)ms);
+}
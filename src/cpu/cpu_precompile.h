@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Finds the BIOS code reachable from the reset and exception vectors by
+// following branches statically, and compiles it on a pool of threads
+// before emulation starts
+namespace Precompile
+{
+	inline bool enabled = false;
+
+	std::vector<uint32_t> DiscoverBIOS(int max_instrs);
+	void Run(int max_instrs);
+};
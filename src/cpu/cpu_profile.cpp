@@ -0,0 +1,127 @@
+#include <cpu/cpu_profile.h>
+#include <cpu/cpu_recomp_core.h>
+#include <memory/Bus.h>
+#include <util/log.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#define MODULE "Profile"
+
+struct ProfileHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t blocks;
+	uint32_t branches;
+};
+
+static constexpr char profile_magic[4] = {'P', 'S', 'X', 'P'};
+static constexpr uint32_t profile_version = 1;
+
+void Profile::Load(int max_instrs)
+{
+	std::atexit(Save);
+
+	FILE* f = fopen(path.c_str(), "rb");
+	if (!f)
+	{
+		log("No profile at %s yet, one will be written on exit\n", path.c_str());
+		return;
+	}
+
+	ProfileHeader header;
+	std::vector<CPURecompiler::ProfiledBlock> hot;
+	std::vector<CPURecompiler::ProfiledBranch> branches;
+
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	rewind(f);
+
+	bool ok = fread(&header, sizeof(header), 1, f) == 1 && !memcmp(header.magic, profile_magic, 4) && header.version == profile_version;
+	// The counts come straight from the file, so check it really holds that much before allocating
+	ok = ok && sizeof(header) + (uint64_t)header.blocks * sizeof(hot[0]) + (uint64_t)header.branches * sizeof(branches[0]) == (uint64_t)size;
+	if (ok)
+	{
+		hot.resize(header.blocks);
+		branches.resize(header.branches);
+		ok = fread(hot.data(), sizeof(hot[0]), hot.size(), f) == hot.size() && fread(branches.data(), sizeof(branches[0]), branches.size(), f) == branches.size();
+	}
+	fclose(f);
+
+	if (!ok)
+	{
+		log("Ignoring %s, it isn't a profile this version can read\n", path.c_str());
+		return;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+
+	Bus::recomp->LoadProfile(hot, branches);
+
+	// RAM is empty until something loads code into it, so only the BIOS can be compiled now
+	std::vector<uint32_t> pcs;
+	for (auto& b : hot)
+	{
+		if (Bus::IsROM(b.phys) && !b.isolated)
+			pcs.push_back(b.phys);
+	}
+
+	// The profile may be from another BIOS, so these go through the speculative
+	// path, which gives up on anything it can't compile
+	std::atomic<size_t> next = 0;
+	std::atomic<size_t> compiled = 0;
+	int count = std::max(1u, std::thread::hardware_concurrency());
+	std::vector<std::thread> workers;
+
+	for (int i = 0; i < count; i++)
+	{
+		workers.emplace_back([&]()
+		{
+			for (size_t b = next++; b < pcs.size(); b = next++)
+			{
+				if (Bus::recomp->CompileSpeculative(pcs[b], max_instrs))
+					compiled++;
+			}
+		});
+	}
+
+	for (auto& w : workers)
+		w.join();
+
+	Bus::recomp->AdoptSpeculated();
+
+	auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+	log("Loaded %zu hot blocks and %zu branches, compiled %zu BIOS blocks in %ldms\n", hot.size(), branches.size(), compiled.load(), (long)ms);
+}
+
+void Profile::Save()
+{
+	std::vector<CPURecompiler::ProfiledBlock> hot;
+	std::vector<CPURecompiler::ProfiledBranch> branches;
+	Bus::recomp->SaveProfile(hot, branches);
+
+	FILE* f = fopen(path.c_str(), "wb");
+	if (!f)
+	{
+		log("Couldn't write the profile to %s\n", path.c_str());
+		return;
+	}
+
+	ProfileHeader header;
+	memcpy(header.magic, profile_magic, 4);
+	header.version = profile_version;
+	header.blocks = hot.size();
+	header.branches = branches.size();
+
+	fwrite(&header, sizeof(header), 1, f);
+	fwrite(hot.data(), sizeof(hot[0]), hot.size(), f);
+	fwrite(branches.data(), sizeof(branches[0]), branches.size(), f);
+	fclose(f);
+
+	log("Saved %zu hot blocks and %zu branches to %s\n", hot.size(), branches.size(), path.c_str());
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Keeps what a run learned about which code is hot between runs. Loading a
+// profile brings back the branch profiles, has blocks that became superblocks
+// traced from their first compile, and compiles the hot BIOS blocks on a pool
+// of threads before emulation starts. No host code is saved
+namespace Profile
+{
+	inline std::string path; // Empty when profiles aren't used
+
+	void Load(int max_instrs);
+	void Save();
+};
@@ -1,6 +1,12 @@
 #include <cpu/cpu_recomp_core.h>
 #include <cpu/cpu_core.h>
+#include <cpu/cpu_loop_idiom.h>
+#include <cpu/cpu_host.h>
+#include <cpu/cpu_speculate.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <fstream>
 
 #ifdef __linux__
@@ -24,17 +30,48 @@ struct MemBlock
 
 #define MEMBLOCK_MAGIC 0x4D454D42
 
-void* CPURecompiler::AllocBlock(uint32_t size)
+// Each instruction is only printed as it's compiled with --disasm
+#define disasm(x, ...) do { if (CPURecompiler::disassemble) printf(x, ##__VA_ARGS__); } while (0)
+
+// Both arenas fit in 2GiB, so anything in one can reach anything in the other with a rel32
+constexpr uint32_t hot_arena_size = 0x20000000;
+constexpr uint32_t cold_arena_size = 0x20000000;
+
+void CPURecompiler::InitArena(uint8_t* arena, uint32_t size)
+{
+	MemBlock* block = (MemBlock*)arena;
+	block->free = true;
+	block->next = nullptr;
+	block->prev = nullptr;
+	block->size = size - sizeof(MemBlock);
+}
+
+void* CPURecompiler::AllocBlock(uint8_t* arena, uint32_t size)
 {
-	MemBlock* b = (MemBlock*)base;
+	std::lock_guard<std::recursive_mutex> lock(arena_mutex);
+	MemBlock*& rover = rovers[arena == base ? 0 : 1];
+	MemBlock* first = rover ? rover : (MemBlock*)arena;
 
-	for (; b; b = b->next)
+	// Keep the headers, and the code after them, aligned
+	size = (size + 15) & ~15;
+
+	// From the rover to the end of the arena, then from the start back round to it
+	MemBlock* b = first;
+	for (bool wrapped = false; b != first || !wrapped; b = b->next)
 	{
+		if (!b)
+		{
+			b = (MemBlock*)arena;
+			wrapped = true;
+			if (b == first)
+				break;
+		}
+
 		if (b->free == true && b->size >= size)
 		{
 			if (b->size >= (size + sizeof(MemBlock) + 4))
 			{
-				MemBlock* nextBlock = (MemBlock*)(b + size + sizeof(MemBlock));
+				MemBlock* nextBlock = (MemBlock*)((uint8_t*)b + sizeof(MemBlock) + size);
 
 				nextBlock->free = true;
 				nextBlock->size = b->size - size - sizeof(MemBlock);
@@ -49,6 +86,7 @@ void* CPURecompiler::AllocBlock(uint32_t size)
 			b->free = false;
 			b->size = size;
 			b->magic = MEMBLOCK_MAGIC;
+			rover = b;
 
 			return (void*)(((uint8_t*)b) + sizeof(MemBlock));
 		}
@@ -58,8 +96,35 @@ void* CPURecompiler::AllocBlock(uint32_t size)
 	exit(1);
 }
 
+// Give back the end of a block once its code turns out smaller than estimated
+void CPURecompiler::ShrinkBlock(void *ptr, uint32_t size)
+{
+	std::lock_guard<std::recursive_mutex> lock(arena_mutex);
+	MemBlock* block = (MemBlock*)((uint8_t*)ptr - sizeof(MemBlock));
+
+	size = (size + 15) & ~15;
+	if (block->size < size + sizeof(MemBlock) + 16)
+		return;
+
+	MemBlock* rest = (MemBlock*)((uint8_t*)ptr + size);
+	rest->free = false;
+	rest->size = block->size - size - sizeof(MemBlock);
+	rest->prev = block;
+	rest->next = block->next;
+	rest->magic = MEMBLOCK_MAGIC;
+	if (block->next)
+		block->next->prev = rest;
+
+	block->next = rest;
+	block->size = size;
+
+	// Merges it with whatever free space follows
+	FreeBlock((uint8_t*)rest + sizeof(MemBlock));
+}
+
 void CPURecompiler::FreeBlock(void *ptr)
 {
+	std::lock_guard<std::recursive_mutex> lock(arena_mutex);
 	MemBlock* block = (MemBlock*)(ptr - sizeof(MemBlock));
 
 	if (block->free || (block->magic != MEMBLOCK_MAGIC))
@@ -73,6 +138,13 @@ void CPURecompiler::FreeBlock(void *ptr)
 
 	if (block->prev && block->prev->free)
 	{
+		// A rover can't be left pointing into the middle of a merged block
+		for (auto& r : rovers)
+		{
+			if (r == block)
+				r = block->prev;
+		}
+
 		block->prev->next = block->next;
 		block->prev->size += block->size + sizeof(MemBlock);
 
@@ -84,6 +156,12 @@ void CPURecompiler::FreeBlock(void *ptr)
 
 	if (block->next && block->next->free)
 	{
+		for (auto& r : rovers)
+		{
+			if (r == block->next)
+				r = block;
+		}
+
 		block->size += block->next->size + sizeof(MemBlock);
 
 		block->next = block->next->next;
@@ -93,78 +171,84 @@ void CPURecompiler::FreeBlock(void *ptr)
 	}
 }
 
-CPURecompiler::CPURecompiler()
+static uint8_t* MapAt(uint8_t* hint, size_t size)
 {
 #ifdef __linux__
-	base = (uint8_t*)mmap(nullptr, 0xffffffff, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	void* p = mmap(hint, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return p == MAP_FAILED ? nullptr : (uint8_t*)p;
+#elif defined(_WIN32)
+	return (uint8_t*)VirtualAlloc(hint, size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#endif
+}
 
-	if (!base)
+static void Unmap(uint8_t* p, size_t size)
+{
+#ifdef __linux__
+	munmap(p, size);
+#elif defined(_WIN32)
+	VirtualFree(p, 0, MEM_RELEASE);
+#endif
+}
+
+// Generated code calls into the emulator all the time, so try to put the arenas just below
+// it, where a rel32 call reaches. Anywhere else still works, with an indirect call
+static uint8_t* MapArenas(size_t size)
+{
+	uintptr_t code = reinterpret_cast<uintptr_t>(&Bus::Read32) & ~(uintptr_t)0xFFFF;
+
+	for (uintptr_t gap = 0x1000000; gap < 0x30000000 && gap + size < code; gap += 0x1000000)
 	{
-		printf("ERROR: Couldn't allocate memory for JIT\n");
-		exit(1);
+		uint8_t* hint = reinterpret_cast<uint8_t*>(code - gap - size);
+		uint8_t* p = MapAt(hint, size);
+		if (p == hint)
+			return p;
+		if (p)
+			Unmap(p, size);
 	}
-#elif defined(_WIN32)
-	base = VirtualAlloc(nullptr, 0xffffffff, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+
+	return MapAt(nullptr, size);
+}
+
+CPURecompiler::CPURecompiler()
+{
+	base = MapArenas(hot_arena_size + cold_arena_size);
 
 	if (!base)
 	{
 		printf("ERROR: Couldn't allocate memory for JIT\n");
 		exit(1);
 	}
-#endif
 
-	MemBlock* block = (MemBlock*)base;
-	block->free = true;
-	block->next = nullptr;
-	block->prev = nullptr;
-	block->size = 0xffffffff - sizeof(MemBlock);
+	cold_base = base + hot_arena_size;
+	InitArena(base, hot_arena_size);
+	InitArena(cold_base, cold_arena_size);
 
-	cur_size = 25;
+	HostCPU::Detect();
+
+	// Every instruction starts with this, and memory operands are slow to encode
+	Xbyak::CodeGenerator inc(sizeof(inc_pc_code), inc_pc_code);
+	inc.mov(inc.ebx, inc.dword[inc.rbp + offsetof(CPUState, next_pc)]);
+	inc.mov(inc.dword[inc.rbp + offsetof(CPUState, pc)], inc.ebx);
+	inc.add(inc.dword[inc.rbp + offsetof(CPUState, next_pc)], 4);
+	inc_pc_size = inc.getSize();
+
+	// Every block that leaves for the dispatcher jumps here
+	void* buffer = AllocBlock(cold_base, 32);
+	Xbyak::CodeGenerator cg(32, buffer);
+	EmitRestore(cg);
+	cg.ret();
+	sequel = cg.getCode();
 
 	Bus::recomp = this;
 }
 
 CPURecompiler::~CPURecompiler()
 {
-#ifdef __linux__
 	if (base)
-		munmap(base, 0xffffffff);
-#endif
+		Unmap(base, hot_arena_size + cold_arena_size);
 }
 
-struct Opcode
-{
-    union
-    {
-        uint32_t full;
-        struct
-        { /* Used when polling for the opcode */
-            uint32_t : 26;
-            uint32_t opcode : 6;
-        };
-        struct
-        {
-            uint32_t imm : 16;
-            uint32_t rt : 5;
-            uint32_t rs : 5;
-            uint32_t opcode : 6;
-        } i_type;
-        struct
-        {
-            uint32_t target : 26;
-            uint32_t opcode : 6;
-        } j_type;
-        struct
-        {
-            uint32_t func : 6;
-            uint32_t sa : 5;
-            uint32_t rd : 5;
-            uint32_t rt : 5;
-            uint32_t rs : 5;
-            uint32_t opcode : 6;
-        } r_type;
-    };
-} cur_instr;
+thread_local Opcode cur_instr;
 
 void CPURecompiler::EmitPrequel(Xbyak::CodeGenerator& cg)
 {
@@ -175,12 +259,42 @@ void CPURecompiler::EmitPrequel(Xbyak::CodeGenerator& cg)
 	cg.push(cg.rdi);
 	cg.push(cg.rsi);
 	cg.push(cg.rbp);
+	cg.push(cg.r12);
+	cg.push(cg.r13);
+	cg.push(cg.r14);
+	cg.push(cg.r15);
 	
 	cg.mov(cg.rbp, reinterpret_cast<size_t>(reinterpret_cast<const void*>(&g_state)));
+
+	// Keep the PC the block was entered at, superblock exits are relative to it
+	cg.mov(cg.r15d, cg.dword[cg.rbp + offsetof(CPUState, pc)]);
 }
 
 void CPURecompiler::EmitSequel(Xbyak::CodeGenerator &cg)
 {
+	cg.jmp(sequel, cg.T_NEAR);
+}
+
+// A jmp from the cold code back into the hot code, pointed at the hot code by BindJumpBack
+// once it gets there. Returns the end of the jmp
+uint8_t* CPURecompiler::EmitJumpBack()
+{
+	cold->jmp(cold->getCurr(), cold->T_NEAR);
+	return const_cast<uint8_t*>(cold->getCurr());
+}
+
+void CPURecompiler::BindJumpBack(Xbyak::CodeGenerator &cg, uint8_t* jump)
+{
+	int32_t rel = (int32_t)(cg.getCurr() - jump);
+	memcpy(jump - 4, &rel, sizeof(rel));
+}
+
+void CPURecompiler::EmitRestore(Xbyak::CodeGenerator &cg)
+{
+	cg.pop(cg.r15);
+	cg.pop(cg.r14);
+	cg.pop(cg.r13);
+	cg.pop(cg.r12);
 	cg.pop(cg.rbp);
 	cg.pop(cg.rsi);
 	cg.pop(cg.rdi);
@@ -188,30 +302,189 @@ void CPURecompiler::EmitSequel(Xbyak::CodeGenerator &cg)
 	cg.pop(cg.rcx);
 	cg.pop(cg.rbx);
 	cg.pop(cg.rax);
+}
 
-	cg.ret();
+// Find the linked block for the guest PC in eax and leave its host code in r11
+void CPURecompiler::EmitLookupLink(Xbyak::CodeGenerator &cg, Xbyak::Label &miss)
+{
+	cg.mov(cg.ecx, cg.eax);
+	cg.shr(cg.ecx, 2);
+	cg.and_(cg.ecx, jump_cache_size - 1);
+	cg.shl(cg.ecx, 4);
+	cg.mov(cg.rdx, reinterpret_cast<uint64_t>(jump_cache));
+	cg.add(cg.rdx, cg.rcx);
+	cg.cmp(cg.dword[cg.rdx + offsetof(BlockLink, pc)], cg.eax);
+	cg.jne(miss, cg.T_NEAR);
+	cg.mov(cg.r11, cg.qword[cg.rdx + offsetof(BlockLink, host)]);
+	cg.test(cg.r11, cg.r11);
+	cg.jz(miss, cg.T_NEAR);
+}
+
+// Push the return address in ebx, along with the block it returns to if that's linked yet
+void CPURecompiler::EmitPushReturn(Xbyak::CodeGenerator &cg)
+{
+	Xbyak::Label push;
+
+	cg.mov(cg.eax, cg.ebx);
+	cg.xor_(cg.r11d, cg.r11d);
+	EmitLookupLink(cg, push);
+
+	cg.L(push);
+	cg.mov(cg.rdx, reinterpret_cast<uint64_t>(&return_stack_top));
+	cg.mov(cg.ecx, cg.dword[cg.rdx]);
+	cg.lea(cg.eax, cg.ptr[cg.rcx + 1]);
+	cg.and_(cg.eax, return_stack_size - 1);
+	cg.mov(cg.dword[cg.rdx], cg.eax);
+	cg.shl(cg.ecx, 4);
+	cg.mov(cg.rdx, reinterpret_cast<uint64_t>(return_stack));
+	cg.add(cg.rdx, cg.rcx);
+	cg.mov(cg.dword[cg.rdx + offsetof(BlockLink, pc)], cg.ebx);
+	cg.mov(cg.qword[cg.rdx + offsetof(BlockLink, host)], cg.r11);
+}
+
+// Leave the block. With chain set, jump straight into the next block if it's linked
+// and there's time left, otherwise return to the dispatcher
+void CPURecompiler::EmitExit(Xbyak::CodeGenerator &cg, bool chain, bool predict_return)
+{
+	Xbyak::Label leave, lookup, jump;
+
+	if (chain)
+	{
+		// Pop even when leaving, so the stack stays in step with the guest's calls
+		if (predict_return)
+		{
+			cg.mov(cg.rdx, reinterpret_cast<uint64_t>(&return_stack_top));
+			cg.mov(cg.ecx, cg.dword[cg.rdx]);
+			cg.dec(cg.ecx);
+			cg.and_(cg.ecx, return_stack_size - 1);
+			cg.mov(cg.dword[cg.rdx], cg.ecx);
+			cg.shl(cg.ecx, 4);
+			cg.mov(cg.rdx, reinterpret_cast<uint64_t>(return_stack));
+			cg.add(cg.rdx, cg.rcx);
+		}
+
+		cg.mov(cg.rax, reinterpret_cast<uint64_t>(&cycle_deadline));
+		cg.mov(cg.rax, cg.qword[cg.rax]);
+		cg.cmp(cg.qword[cg.rbp + offsetof(CPUState, cycles)], cg.rax);
+		cg.jae(leave, cg.T_NEAR);
+
+		cg.mov(cg.eax, cg.dword[cg.rbp + offsetof(CPUState, pc)]);
+
+		if (predict_return)
+		{
+			cg.cmp(cg.dword[cg.rdx + offsetof(BlockLink, pc)], cg.eax);
+			cg.jne(lookup, cg.T_NEAR);
+			cg.mov(cg.r11, cg.qword[cg.rdx + offsetof(BlockLink, host)]);
+			cg.test(cg.r11, cg.r11);
+			cg.jnz(jump, cg.T_NEAR);
+			cg.L(lookup);
+		}
+
+		EmitLookupLink(cg, leave);
+
+		cg.L(jump);
+		EmitRestore(cg);
+		cg.jmp(cg.r11);
+	}
+
+	cg.L(leave);
+	EmitSequel(cg);
 }
 
 void CPURecompiler::EmitIncPC(Xbyak::CodeGenerator &cg)
 {
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, next_pc)]);
-	cg.mov(cg.ebx, cg.dword[cg.rax]);
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, pc)]);
-	cg.mov(cg.dword[cg.rax], cg.ebx);
-	
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, next_pc)]);
-	cg.add(cg.dword[cg.rax], 4);
+	cg.db(inc_pc_code, inc_pc_size);
 }
 
-void CPURecompiler::EmitHandleLoadDelay(Xbyak::CodeGenerator &cg)
+// A direct call when the helper is in reach of the arena, which it normally is
+void CPURecompiler::EmitCall(Xbyak::CodeGenerator &cg, const void* func)
 {
-	cg.mov(cg.rax, reinterpret_cast<uint64_t>(HandleLoadDelay));
+	int64_t rel = reinterpret_cast<const uint8_t*>(func) - (cg.getCurr() + 5);
+
+	if (rel == (int32_t)rel)
+	{
+		cg.call(func);
+		return;
+	}
+
+	cg.mov(cg.rax, reinterpret_cast<uint64_t>(func));
 	cg.call(cg.rax);
 }
 
+void CPURecompiler::EmitHandleLoadDelay(Xbyak::CodeGenerator &cg)
+{
+	EmitCall(cg, reinterpret_cast<const void*>(HandleLoadDelay));
+}
+
+// Used in place of a bus read when the loaded value is known at compile time
+void CPURecompiler::EmitFoldedLoad(Xbyak::CodeGenerator &cg, uint32_t value)
+{
+	cg.push(cg.rbp);
+
+	cg.mov(cg.rbp, reinterpret_cast<uint64_t>(&next_load_delay));
+	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(LoadDelaySlot, reg)]);
+	cg.mov(cg.dword[cg.rax], cur_instr.i_type.rt);
+	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(LoadDelaySlot, data)]);
+	cg.mov(cg.dword[cg.rax], value);
+
+	cg.pop(cg.rbp);
+}
+
+void CPURecompiler::EmitLoadReg(Xbyak::CodeGenerator &cg, const Xbyak::Reg32 &dst, int reg)
+{
+	if (loop_regs[reg])
+		cg.mov(dst, Xbyak::Reg32(loop_regs[reg]));
+	else
+		cg.mov(dst, cg.dword[cg.rbp + offsetof(CPUState, regs) + (reg * 4)]);
+}
+
+void CPURecompiler::EmitStoreReg(Xbyak::CodeGenerator &cg, int reg, const Xbyak::Reg32 &src)
+{
+	if (loop_regs[reg])
+		cg.mov(Xbyak::Reg32(loop_regs[reg]), src);
+	else
+		cg.mov(cg.dword[cg.rbp + offsetof(CPUState, regs) + (reg * 4)], src);
+}
+
+void CPURecompiler::EmitStoreReg(Xbyak::CodeGenerator &cg, int reg, uint32_t value)
+{
+	if (loop_regs[reg])
+		cg.mov(Xbyak::Reg32(loop_regs[reg]), value);
+	else
+		cg.mov(cg.dword[cg.rbp + offsetof(CPUState, regs) + (reg * 4)], value);
+}
+
+// Count which way a branch goes, so hot blocks can be turned into superblocks
+// along the common path. Called at the end of the taken path, and binds not_taken
+void CPURecompiler::EmitProfileBranch(Xbyak::CodeGenerator &cg, Xbyak::Label &not_taken)
+{
+	cache_mutex.lock();
+	BranchProfile& profile = branchProfiles[cur_addr];
+	cache_mutex.unlock();
+	Xbyak::Label done;
+
+	cg.mov(cg.rax, reinterpret_cast<uint64_t>(&profile.taken));
+	cg.inc(cg.dword[cg.rax]);
+	cg.jmp(done);
+
+	cg.L(not_taken);
+	cg.mov(cg.rax, reinterpret_cast<uint64_t>(&profile.not_taken));
+	cg.inc(cg.dword[cg.rax]);
+
+	cg.L(done);
+}
+
+// Leave the superblock if the branch before went the other way
+void CPURecompiler::EmitTraceExit(Xbyak::CodeGenerator &cg, uint32_t expected, const uint8_t* exit)
+{
+	cg.lea(cg.eax, cg.ptr[cg.r15 + (int32_t)(expected - cur_addrs.front())]);
+	cg.cmp(cg.dword[cg.rbp + offsetof(CPUState, pc)], cg.eax);
+	cg.jne(exit);
+}
+
 void CPURecompiler::EmitJ(Xbyak::CodeGenerator &cg)
 {
-	printf("j 0x%08x\n", (g_state.next_pc & 0xf0000000) | (cur_instr.j_type.target << 2));
+	disasm("j 0x%08x\n", (g_state.next_pc & 0xf0000000) | (cur_instr.j_type.target << 2));
 
 	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, next_pc)]);
 	cg.mov(cg.ebx, cg.dword[cg.rax]);
@@ -223,12 +496,22 @@ void CPURecompiler::EmitJ(Xbyak::CodeGenerator &cg)
 
 void CPURecompiler::EmitJAL(Xbyak::CodeGenerator &cg)
 {
-	printf("jal 0x%08x (0x%08x)\n", (g_state.next_pc & 0xf0000000) | (cur_instr.j_type.target << 2), g_state.pc);
+	disasm("jal 0x%08x (0x%08x)\n", (g_state.next_pc & 0xf0000000) | (cur_instr.j_type.target << 2), g_state.pc);
 
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, next_pc)]);
-	cg.mov(cg.ebx, cg.dword[cg.rax]);
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (31 * 4)]);
-	cg.mov(cg.dword[cg.rax], cg.ebx);
+	if (cur_inlined)
+	{
+		// The return is compiled in, so $ra is only written for the guest's sake and
+		// nothing goes on the return stack
+		cg.lea(cg.eax, cg.ptr[cg.r15 + (int32_t)(cur_addr + 8 - cur_addrs.front())]);
+		EmitStoreReg(cg, 31, cg.eax);
+	}
+	else
+	{
+		cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, next_pc)]);
+		cg.mov(cg.ebx, cg.dword[cg.rax]);
+		EmitStoreReg(cg, 31, cg.ebx);
+		EmitPushReturn(cg);
+	}
 
 	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, next_pc)]);
 	cg.mov(cg.ebx, cg.dword[cg.rax]);
@@ -240,17 +523,15 @@ void CPURecompiler::EmitJAL(Xbyak::CodeGenerator &cg)
 
 void CPURecompiler::EmitBEQ(Xbyak::CodeGenerator &cg)
 {
-	printf("beq %s, %s, 0x%08x\n", GetRegName(cur_instr.i_type.rt),  GetRegName(cur_instr.i_type.rs), (g_state.next_pc + (int32_t)(cur_instr.i_type.imm << 2)));
+	disasm("beq %s, %s, 0x%08x\n", GetRegName(cur_instr.i_type.rt),  GetRegName(cur_instr.i_type.rs), (g_state.next_pc + (int32_t)(cur_instr.i_type.imm << 2)));
 
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.i_type.rs * sizeof(uint32_t))]);
-	cg.mov(cg.ebx, cg.dword[cg.rax]);
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.i_type.rt * sizeof(uint32_t))]);
-	cg.mov(cg.ecx, cg.dword[cg.rax]);
+	EmitLoadReg(cg, cg.ebx, cur_instr.i_type.rs);
+	EmitLoadReg(cg, cg.ecx, cur_instr.i_type.rt);
 	
 	cg.cmp(cg.ecx, cg.ebx);
 
 	Xbyak::Label not_equal;
-	cg.jne(not_equal);
+	cg.jne(not_equal, cg.T_NEAR);
 
 	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, pc)]);
 	cg.mov(cg.ebx, cg.dword[cg.rax]);
@@ -258,22 +539,23 @@ void CPURecompiler::EmitBEQ(Xbyak::CodeGenerator &cg)
 	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, next_pc)]);
 	cg.mov(cg.dword[cg.rax], cg.ebx);
 
-	cg.L(not_equal);
+	if (!tracing)
+		EmitProfileBranch(cg, not_equal);
+	else
+		cg.L(not_equal);
 }
 
 void CPURecompiler::EmitBNE(Xbyak::CodeGenerator &cg)
 {
-	printf("bne %s, %s, 0x%08x\n", GetRegName(cur_instr.i_type.rt),  GetRegName(cur_instr.i_type.rs), (g_state.next_pc + (int32_t)(cur_instr.i_type.imm << 2)));
+	disasm("bne %s, %s, 0x%08x\n", GetRegName(cur_instr.i_type.rt),  GetRegName(cur_instr.i_type.rs), (g_state.next_pc + (int32_t)(cur_instr.i_type.imm << 2)));
 
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.i_type.rs * sizeof(uint32_t))]);
-	cg.mov(cg.ebx, cg.dword[cg.rax]);
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.i_type.rt * sizeof(uint32_t))]);
-	cg.mov(cg.ecx, cg.dword[cg.rax]);
+	EmitLoadReg(cg, cg.ebx, cur_instr.i_type.rs);
+	EmitLoadReg(cg, cg.ecx, cur_instr.i_type.rt);
 	
 	cg.cmp(cg.ecx, cg.ebx);
 
 	Xbyak::Label equal;
-	cg.je(equal);
+	cg.je(equal, cg.T_NEAR);
 
 	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, pc)]);
 	cg.mov(cg.ebx, cg.dword[cg.rax]);
@@ -281,44 +563,52 @@ void CPURecompiler::EmitBNE(Xbyak::CodeGenerator &cg)
 	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, next_pc)]);
 	cg.mov(cg.dword[cg.rax], cg.ebx);
 
-	cg.L(equal);
+	if (!tracing)
+		EmitProfileBranch(cg, equal);
+	else
+		cg.L(equal);
 }
 
 void CPURecompiler::EmitAddiu(Xbyak::CodeGenerator &cg)
 {
-	printf("%s %s, %s, 0x%04x\n", cur_instr.opcode == 0x08 ? "addi" : "addiu", GetRegName(cur_instr.i_type.rt), GetRegName(cur_instr.i_type.rs), (int32_t)(int16_t)cur_instr.i_type.imm);
+	disasm("%s %s, %s, 0x%04x\n", cur_instr.opcode == 0x08 ? "addi" : "addiu", GetRegName(cur_instr.i_type.rt), GetRegName(cur_instr.i_type.rs), (int32_t)(int16_t)cur_instr.i_type.imm);
 
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.i_type.rs * sizeof(uint32_t))]);
-	cg.mov(cg.ebx, cg.dword[cg.rax]);
+	EmitLoadReg(cg, cg.ebx, cur_instr.i_type.rs);
 	cg.mov(cg.ecx, static_cast<int32_t>(static_cast<int16_t>(cur_instr.i_type.imm)));
 	cg.add(cg.ebx, cg.ecx);
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.i_type.rt * sizeof(uint32_t))]);
-	cg.mov(cg.dword[cg.rax], cg.ebx);
+	EmitStoreReg(cg, cur_instr.i_type.rt, cg.ebx);
 }
 
 void CPURecompiler::EmitLUI(Xbyak::CodeGenerator &cg)
 {
-	printf("lui %s, 0x%04x\n", GetRegName(cur_instr.i_type.rt), cur_instr.i_type.imm);
+	disasm("lui %s, 0x%04x\n", GetRegName(cur_instr.i_type.rt), cur_instr.i_type.imm);
 
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.i_type.rt * 4)]);
-	cg.mov(cg.dword[cg.rax], static_cast<uint32_t>(cur_instr.i_type.imm << 16));
+	EmitStoreReg(cg, cur_instr.i_type.rt, static_cast<uint32_t>(cur_instr.i_type.imm << 16));
 }
 
 void CPURecompiler::EmitLB(Xbyak::CodeGenerator &cg)
 {
-	printf("lb %s, %d(%s)\n", GetRegName(cur_instr.i_type.rt), cur_instr.i_type.imm, GetRegName(cur_instr.i_type.rs));
+	disasm("lb %s, %d(%s)\n", GetRegName(cur_instr.i_type.rt), cur_instr.i_type.imm, GetRegName(cur_instr.i_type.rs));
+
+	if (EmitFastAccess(cg))
+		return;
+
+	uint32_t addr;
+	if (GetConstAddr(addr) && Bus::IsROM(Bus::mask_region(addr)))
+	{
+		EmitFoldedLoad(cg, (int32_t)(int8_t)Bus::Read8(addr));
+		return;
+	}
 
 	// Grab the register and add the offset to it
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.i_type.rs * 4)]);
-	cg.mov(cg.edi, cg.dword[cg.rax]);
+	EmitLoadReg(cg, cg.edi, cur_instr.i_type.rs);
 	cg.add(cg.edi, (int32_t)(int16_t)cur_instr.i_type.imm);
 
-	// Call Read32 with the address in edi
-	cg.mov(cg.rax, reinterpret_cast<uint64_t>(Bus::Read8));
-	cg.call(cg.rax);
+	// Call Read8 with the address in edi
+	EmitCall(cg, reinterpret_cast<const void*>(Bus::Read8));
 
-	// Save the result
-	cg.mov(cg.rbx, cg.rax);
+	// Save the sign-extended result
+	cg.movsx(cg.ebx, cg.al);
 	
 	cg.push(cg.rbp);
 
@@ -333,21 +623,29 @@ void CPURecompiler::EmitLB(Xbyak::CodeGenerator &cg)
 	cg.pop(cg.rbp);
 }
 
-void CPURecompiler::EmitLW(Xbyak::CodeGenerator &cg)
+void CPURecompiler::EmitLH(Xbyak::CodeGenerator &cg)
 {
-	printf("lw %s, %d(%s)\n", GetRegName(cur_instr.i_type.rt), cur_instr.i_type.imm, GetRegName(cur_instr.i_type.rs));
+	disasm("lh %s, %d(%s)\n", GetRegName(cur_instr.i_type.rt), cur_instr.i_type.imm, GetRegName(cur_instr.i_type.rs));
+
+	if (EmitFastAccess(cg))
+		return;
+
+	uint32_t addr;
+	if (GetConstAddr(addr) && (addr & 1) == 0 && Bus::IsROM(Bus::mask_region(addr)))
+	{
+		EmitFoldedLoad(cg, (int32_t)(int16_t)Bus::Read16(addr));
+		return;
+	}
 
 	// Grab the register and add the offset to it
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.i_type.rs * 4)]);
-	cg.mov(cg.edi, cg.dword[cg.rax]);
+	EmitLoadReg(cg, cg.edi, cur_instr.i_type.rs);
 	cg.add(cg.edi, (int32_t)(int16_t)cur_instr.i_type.imm);
 
-	// Call Read32 with the address in edi
-	cg.mov(cg.rax, reinterpret_cast<uint64_t>(Bus::Read32));
-	cg.call(cg.rax);
+	// Call Read16 with the address in edi
+	EmitCall(cg, reinterpret_cast<const void*>(Bus::Read16));
 
-	// Save the result
-	cg.mov(cg.rbx, cg.rax);
+	// Save the sign-extended result
+	cg.movsx(cg.ebx, cg.ax);
 	
 	cg.push(cg.rbp);
 
@@ -362,370 +660,2418 @@ void CPURecompiler::EmitLW(Xbyak::CodeGenerator &cg)
 	cg.pop(cg.rbp);
 }
 
-void CPURecompiler::EmitSB(Xbyak::CodeGenerator &cg)
+void CPURecompiler::EmitLBU(Xbyak::CodeGenerator &cg)
 {
-	printf("sb %s, %d(%s)\n", GetRegName(cur_instr.i_type.rt), cur_instr.i_type.imm, GetRegName(cur_instr.i_type.rs));
+	disasm("lbu %s, %d(%s)\n", GetRegName(cur_instr.i_type.rt), cur_instr.i_type.imm, GetRegName(cur_instr.i_type.rs));
 
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.i_type.rs * 4)]);
-	cg.mov(cg.ebx, cg.dword[cg.rax]);
-	cg.add(cg.ebx, (int32_t)((int16_t)cur_instr.i_type.imm));
-	cg.mov(cg.rdi, cg.rbx);
+	if (EmitFastAccess(cg))
+		return;
 
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.i_type.rt * 4)]);
-	cg.mov(cg.esi, cg.dword[cg.rax]);
+	uint32_t addr;
+	if (GetConstAddr(addr) && Bus::IsROM(Bus::mask_region(addr)))
+	{
+		EmitFoldedLoad(cg, Bus::Read8(addr));
+		return;
+	}
 
-	Xbyak::Label skip_cache;
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, cop0) + (12*4)]);
-	cg.mov(cg.ebx, cg.dword[cg.rax]);
-	cg.and_(cg.ebx, (1 << 16));
-	cg.jnz(skip_cache);
+	// Grab the register and add the offset to it
+	EmitLoadReg(cg, cg.edi, cur_instr.i_type.rs);
+	cg.add(cg.edi, (int32_t)(int16_t)cur_instr.i_type.imm);
 
-	cg.mov(cg.rax, reinterpret_cast<size_t>(Bus::Write8));
-	cg.call(cg.rax);
+	// Call Read8 with the address in edi
+	EmitCall(cg, reinterpret_cast<const void*>(Bus::Read8));
+
+	// Save the zero-extended result
+	cg.movzx(cg.ebx, cg.al);
+	
+	cg.push(cg.rbp);
+
+	// Set up load delay slot
+	cg.mov(cg.rbp, reinterpret_cast<uint64_t>(&next_load_delay));
+	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(LoadDelaySlot, reg)]);
+	cg.mov(cg.dword[cg.rax], cur_instr.i_type.rt);
+	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(LoadDelaySlot, data)]);
+	cg.mov(cg.dword[cg.rax], cg.ebx);
 
-	cg.L(skip_cache);
+	// Restore rbp
+	cg.pop(cg.rbp);
 }
 
-void CPURecompiler::EmitSH(Xbyak::CodeGenerator &cg)
+void CPURecompiler::EmitLHU(Xbyak::CodeGenerator &cg)
 {
-	printf("sh %s, %d(%s)\n", GetRegName(cur_instr.i_type.rt), cur_instr.i_type.imm, GetRegName(cur_instr.i_type.rs));
+	disasm("lhu %s, %d(%s)\n", GetRegName(cur_instr.i_type.rt), cur_instr.i_type.imm, GetRegName(cur_instr.i_type.rs));
 
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.i_type.rs * 4)]);
-	cg.mov(cg.ebx, cg.dword[cg.rax]);
-	cg.add(cg.ebx, (int32_t)((int16_t)cur_instr.i_type.imm));
-	cg.mov(cg.rdi, cg.rbx);
+	if (EmitFastAccess(cg))
+		return;
+
+	uint32_t addr;
+	if (GetConstAddr(addr) && (addr & 1) == 0 && Bus::IsROM(Bus::mask_region(addr)))
+	{
+		EmitFoldedLoad(cg, Bus::Read16(addr));
+		return;
+	}
 
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.i_type.rt * 4)]);
-	cg.mov(cg.esi, cg.dword[cg.rax]);
+	// Grab the register and add the offset to it
+	EmitLoadReg(cg, cg.edi, cur_instr.i_type.rs);
+	cg.add(cg.edi, (int32_t)(int16_t)cur_instr.i_type.imm);
 
-	Xbyak::Label skip_cache;
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, cop0) + (12*4)]);
-	cg.mov(cg.ebx, cg.dword[cg.rax]);
-	cg.and_(cg.ebx, (1 << 16));
-	cg.jnz(skip_cache);
+	// Call Read16 with the address in edi
+	EmitCall(cg, reinterpret_cast<const void*>(Bus::Read16));
 
-	cg.mov(cg.rax, reinterpret_cast<size_t>(Bus::Write16));
-	cg.call(cg.rax);
+	// Save the zero-extended result
+	cg.movzx(cg.ebx, cg.ax);
+	
+	cg.push(cg.rbp);
+
+	// Set up load delay slot
+	cg.mov(cg.rbp, reinterpret_cast<uint64_t>(&next_load_delay));
+	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(LoadDelaySlot, reg)]);
+	cg.mov(cg.dword[cg.rax], cur_instr.i_type.rt);
+	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(LoadDelaySlot, data)]);
+	cg.mov(cg.dword[cg.rax], cg.ebx);
 
-	cg.L(skip_cache);
+	// Restore rbp
+	cg.pop(cg.rbp);
 }
 
-void CPURecompiler::EmitSW(Xbyak::CodeGenerator &cg)
+void CPURecompiler::EmitLW(Xbyak::CodeGenerator &cg)
 {
-	printf("sw %s, %d(%s)\n", GetRegName(cur_instr.i_type.rt), cur_instr.i_type.imm, GetRegName(cur_instr.i_type.rs));
-
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.i_type.rs * 4)]);
-	cg.mov(cg.ebx, cg.dword[cg.rax]);
-	cg.add(cg.ebx, (int32_t)((int16_t)cur_instr.i_type.imm));
-	cg.mov(cg.rdi, cg.rbx);
+	disasm("lw %s, %d(%s)\n", GetRegName(cur_instr.i_type.rt), cur_instr.i_type.imm, GetRegName(cur_instr.i_type.rs));
 
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.i_type.rt * 4)]);
-	cg.mov(cg.esi, cg.dword[cg.rax]);
+	if (EmitFastAccess(cg))
+		return;
 
-	Xbyak::Label skip_cache;
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, cop0) + (12*4)]);
-	cg.mov(cg.ebx, cg.dword[cg.rax]);
-	cg.and_(cg.ebx, (1 << 16));
-	cg.jnz(skip_cache);
+	uint32_t addr;
+	if (GetConstAddr(addr) && (addr & 3) == 0 && Bus::IsROM(Bus::mask_region(addr)))
+	{
+		EmitFoldedLoad(cg, Bus::Read32(addr));
+		return;
+	}
 
-	cg.mov(cg.rax, reinterpret_cast<size_t>(Bus::Write32));
-	cg.call(cg.rax);
+	// Grab the register and add the offset to it
+	EmitLoadReg(cg, cg.edi, cur_instr.i_type.rs);
+	cg.add(cg.edi, (int32_t)(int16_t)cur_instr.i_type.imm);
 
-	cg.L(skip_cache);
-}
+	// Call Read32 with the address in edi
+	EmitCall(cg, reinterpret_cast<const void*>(Bus::Read32));
 
-void CPURecompiler::EmitANDI(Xbyak::CodeGenerator &cg)
-{
-	printf("andi %s, %s, 0x%04x\n", GetRegName(cur_instr.i_type.rt), GetRegName(cur_instr.i_type.rs), cur_instr.i_type.imm);
+	// Save the result
+	cg.mov(cg.rbx, cg.rax);
+	
+	cg.push(cg.rbp);
 
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.i_type.rs * 4)]);
-	cg.mov(cg.ebx, cg.dword[cg.rax]);
-	cg.and_(cg.ebx, cur_instr.i_type.imm);
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.i_type.rt * 4)]);
+	// Set up load delay slot
+	cg.mov(cg.rbp, reinterpret_cast<uint64_t>(&next_load_delay));
+	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(LoadDelaySlot, reg)]);
+	cg.mov(cg.dword[cg.rax], cur_instr.i_type.rt);
+	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(LoadDelaySlot, data)]);
 	cg.mov(cg.dword[cg.rax], cg.ebx);
+
+	// Restore rbp
+	cg.pop(cg.rbp);
 }
 
-void CPURecompiler::EmitORI(Xbyak::CodeGenerator& cg)
+void CPURecompiler::EmitSB(Xbyak::CodeGenerator &cg)
 {
-	printf("ori %s, %s, 0x%04x\n", GetRegName(cur_instr.i_type.rt), GetRegName(cur_instr.i_type.rs), cur_instr.i_type.imm);
+	disasm("sb %s, %d(%s)\n", GetRegName(cur_instr.i_type.rt), cur_instr.i_type.imm, GetRegName(cur_instr.i_type.rs));
 
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.i_type.rs * 4)]);
-	cg.mov(cg.ebx, cg.dword[cg.rax]);
-	cg.or_(cg.ebx, cur_instr.i_type.imm);
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.i_type.rt * 4)]);
-	cg.mov(cg.dword[cg.rax], cg.ebx);
-}
+	if (EmitFastAccess(cg))
+		return;
 
-void CPURecompiler::EmitJR(Xbyak::CodeGenerator &cg)
-{
-	printf("jr %s (0x%08x)\n", GetRegName(cur_instr.i_type.rs), g_state.regs[cur_instr.i_type.rs]);
+	EmitLoadReg(cg, cg.ebx, cur_instr.i_type.rs);
+	cg.add(cg.ebx, (int32_t)((int16_t)cur_instr.i_type.imm));
+	cg.mov(cg.rdi, cg.rbx);
 
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.i_type.rs * 4)]);
-	cg.mov(cg.ebx, cg.dword[cg.rax]);
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, next_pc)]);
-	cg.mov(cg.dword[cg.rax], cg.ebx);
+	EmitLoadReg(cg, cg.esi, cur_instr.i_type.rt);
+
+	// Blocks are compiled for one cache isolation state, so there's no need to check SR here
+	if (isolated)
+		EmitCall(cg, reinterpret_cast<const void*>(Bus::WriteIsolated));
+	else
+		EmitCall(cg, reinterpret_cast<const void*>(Bus::Write8));
 }
 
-void CPURecompiler::EmitADDU(Xbyak::CodeGenerator &cg)
+void CPURecompiler::EmitSH(Xbyak::CodeGenerator &cg)
 {
-	printf("addu %s, %s, %s\n", GetRegName(cur_instr.r_type.rd), GetRegName(cur_instr.r_type.rt), GetRegName(cur_instr.r_type.rs));
+	disasm("sh %s, %d(%s)\n", GetRegName(cur_instr.i_type.rt), cur_instr.i_type.imm, GetRegName(cur_instr.i_type.rs));
 
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.r_type.rs * 4)]);
-	cg.mov(cg.ebx, cg.dword[cg.rax]);
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.r_type.rt * 4)]);
-	cg.mov(cg.ecx, cg.dword[cg.rax]);
+	if (EmitFastAccess(cg))
+		return;
+
+	EmitLoadReg(cg, cg.ebx, cur_instr.i_type.rs);
+	cg.add(cg.ebx, (int32_t)((int16_t)cur_instr.i_type.imm));
+	cg.mov(cg.rdi, cg.rbx);
+
+	EmitLoadReg(cg, cg.esi, cur_instr.i_type.rt);
+
+	// Blocks are compiled for one cache isolation state, so there's no need to check SR here
+	if (isolated)
+		EmitCall(cg, reinterpret_cast<const void*>(Bus::WriteIsolated));
+	else
+		EmitCall(cg, reinterpret_cast<const void*>(Bus::Write16));
+}
+
+void CPURecompiler::EmitSW(Xbyak::CodeGenerator &cg)
+{
+	disasm("sw %s, %d(%s)\n", GetRegName(cur_instr.i_type.rt), cur_instr.i_type.imm, GetRegName(cur_instr.i_type.rs));
+
+	if (EmitFastAccess(cg))
+		return;
+
+	EmitLoadReg(cg, cg.ebx, cur_instr.i_type.rs);
+	cg.add(cg.ebx, (int32_t)((int16_t)cur_instr.i_type.imm));
+	cg.mov(cg.rdi, cg.rbx);
+
+	EmitLoadReg(cg, cg.esi, cur_instr.i_type.rt);
+
+	// Blocks are compiled for one cache isolation state, so there's no need to check SR here
+	if (isolated)
+		EmitCall(cg, reinterpret_cast<const void*>(Bus::WriteIsolated));
+	else
+		EmitCall(cg, reinterpret_cast<const void*>(Bus::Write32));
+}
+
+// The unaligned accesses work on the aligned word containing addr. "Left" is the
+// most significant end of the register, which is the higher addresses
+static uint32_t LoadLeft(uint32_t addr, uint32_t cur)
+{
+	uint32_t word = Bus::Read32(addr & ~3);
+	int shift = (3 - (addr & 3)) * 8;
+	return (cur & ~(0xFFFFFFFFu << shift)) | (word << shift);
+}
+
+static uint32_t LoadRight(uint32_t addr, uint32_t cur)
+{
+	uint32_t word = Bus::Read32(addr & ~3);
+	int shift = (addr & 3) * 8;
+	return (cur & ~(0xFFFFFFFFu >> shift)) | (word >> shift);
+}
+
+static void StoreLeft(uint32_t addr, uint32_t value)
+{
+	uint32_t word = Bus::Read32(addr & ~3);
+	int shift = (3 - (addr & 3)) * 8;
+	Bus::Write32(addr & ~3, (word & ~(0xFFFFFFFFu >> shift)) | (value >> shift));
+}
+
+static void StoreRight(uint32_t addr, uint32_t value)
+{
+	uint32_t word = Bus::Read32(addr & ~3);
+	int shift = (addr & 3) * 8;
+	Bus::Write32(addr & ~3, (word & ~(0xFFFFFFFFu << shift)) | (value << shift));
+}
+
+// A whole lwl/lwr or swl/swr pair, for when the address isn't in RAM
+static uint32_t LoadUnaligned(uint32_t addr)
+{
+	return LoadLeft(addr + 3, LoadRight(addr, 0));
+}
+
+static void StoreUnaligned(uint32_t addr, uint32_t value)
+{
+	StoreRight(addr, value);
+	StoreLeft(addr + 3, value);
+}
+
+// Takes the value like the other store helpers, but nothing reaches memory
+static void StoreIsolated(uint32_t addr, uint32_t)
+{
+	Bus::WriteIsolated(addr);
+}
+
+static void MarkWordDirty(uint32_t address)
+{
+	Bus::recomp->MarkBlockDirty(address);
+	Bus::recomp->MarkBlockDirty(address + 3);
+}
+
+void CPURecompiler::EmitLWL(Xbyak::CodeGenerator &cg)
+{
+	disasm("lwl %s, %d(%s)\n", GetRegName(cur_instr.i_type.rt), cur_instr.i_type.imm, GetRegName(cur_instr.i_type.rs));
+	EmitUnaligned(cg, reinterpret_cast<const void*>(LoadLeft));
+}
+
+void CPURecompiler::EmitLWR(Xbyak::CodeGenerator &cg)
+{
+	disasm("lwr %s, %d(%s)\n", GetRegName(cur_instr.i_type.rt), cur_instr.i_type.imm, GetRegName(cur_instr.i_type.rs));
+	EmitUnaligned(cg, reinterpret_cast<const void*>(LoadRight));
+}
+
+void CPURecompiler::EmitSWL(Xbyak::CodeGenerator &cg)
+{
+	disasm("swl %s, %d(%s)\n", GetRegName(cur_instr.i_type.rt), cur_instr.i_type.imm, GetRegName(cur_instr.i_type.rs));
+	EmitUnaligned(cg, reinterpret_cast<const void*>(isolated ? StoreIsolated : StoreLeft));
+}
+
+void CPURecompiler::EmitSWR(Xbyak::CodeGenerator &cg)
+{
+	disasm("swr %s, %d(%s)\n", GetRegName(cur_instr.i_type.rt), cur_instr.i_type.imm, GetRegName(cur_instr.i_type.rs));
+	EmitUnaligned(cg, reinterpret_cast<const void*>(isolated ? StoreIsolated : StoreRight));
+}
+
+// Call func with the address in edi and rt in esi. Loads put the result in the load delay slot
+void CPURecompiler::EmitUnaligned(Xbyak::CodeGenerator &cg, const void* func)
+{
+	bool load = cur_instr.opcode == Instructions::lwl || cur_instr.opcode == Instructions::lwr;
+
+	EmitLoadReg(cg, cg.edi, cur_instr.i_type.rs);
+	cg.add(cg.edi, (int32_t)(int16_t)cur_instr.i_type.imm);
+	EmitLoadReg(cg, cg.esi, cur_instr.i_type.rt);
+
+	// A load into rt from the instruction before hasn't landed yet, but lwl and lwr
+	// merge with it anyway
+	if (load)
+	{
+		Xbyak::Label merge;
+		cg.mov(cg.rax, reinterpret_cast<uint64_t>(&load_delay_slot));
+		cg.cmp(cg.dword[cg.rax + offsetof(LoadDelaySlot, reg)], cur_instr.i_type.rt);
+		cg.jne(merge);
+		cg.mov(cg.esi, cg.dword[cg.rax + offsetof(LoadDelaySlot, data)]);
+		cg.L(merge);
+	}
+
+	EmitCall(cg, func);
+
+	if (load)
+	{
+		cg.mov(cg.rdx, reinterpret_cast<uint64_t>(&next_load_delay));
+		cg.mov(cg.dword[cg.rdx + offsetof(LoadDelaySlot, reg)], cur_instr.i_type.rt);
+		cg.mov(cg.dword[cg.rdx + offsetof(LoadDelaySlot, data)], cg.eax);
+	}
+}
+
+void CPURecompiler::EmitANDI(Xbyak::CodeGenerator &cg)
+{
+	disasm("andi %s, %s, 0x%04x\n", GetRegName(cur_instr.i_type.rt), GetRegName(cur_instr.i_type.rs), cur_instr.i_type.imm);
+
+	EmitLoadReg(cg, cg.ebx, cur_instr.i_type.rs);
+	cg.and_(cg.ebx, cur_instr.i_type.imm);
+	EmitStoreReg(cg, cur_instr.i_type.rt, cg.ebx);
+}
+
+void CPURecompiler::EmitORI(Xbyak::CodeGenerator& cg)
+{
+	disasm("ori %s, %s, 0x%04x\n", GetRegName(cur_instr.i_type.rt), GetRegName(cur_instr.i_type.rs), cur_instr.i_type.imm);
+
+	EmitLoadReg(cg, cg.ebx, cur_instr.i_type.rs);
+	cg.or_(cg.ebx, cur_instr.i_type.imm);
+	EmitStoreReg(cg, cur_instr.i_type.rt, cg.ebx);
+}
+
+void CPURecompiler::EmitSLL(Xbyak::CodeGenerator &cg)
+{
+	disasm("sll %s, %s, %d\n", GetRegName(cur_instr.r_type.rd), GetRegName(cur_instr.r_type.rt), cur_instr.r_type.sa);
+
+	EmitLoadReg(cg, cg.ebx, cur_instr.r_type.rt);
+	cg.shl(cg.ebx, cur_instr.r_type.sa);
+
+	if (cur_instr.r_type.rd)
+		EmitStoreReg(cg, cur_instr.r_type.rd, cg.ebx);
+}
+
+void CPURecompiler::EmitSRL(Xbyak::CodeGenerator &cg)
+{
+	disasm("srl %s, %s, %d\n", GetRegName(cur_instr.r_type.rd), GetRegName(cur_instr.r_type.rt), cur_instr.r_type.sa);
+
+	EmitLoadReg(cg, cg.ebx, cur_instr.r_type.rt);
+	cg.shr(cg.ebx, cur_instr.r_type.sa);
+
+	if (cur_instr.r_type.rd)
+		EmitStoreReg(cg, cur_instr.r_type.rd, cg.ebx);
+}
+
+void CPURecompiler::EmitSRA(Xbyak::CodeGenerator &cg)
+{
+	disasm("sra %s, %s, %d\n", GetRegName(cur_instr.r_type.rd), GetRegName(cur_instr.r_type.rt), cur_instr.r_type.sa);
+
+	EmitLoadReg(cg, cg.ebx, cur_instr.r_type.rt);
+	cg.sar(cg.ebx, cur_instr.r_type.sa);
+
+	if (cur_instr.r_type.rd)
+		EmitStoreReg(cg, cur_instr.r_type.rd, cg.ebx);
+}
+
+// x86 masks 32 bit shift counts to 5 bits, same as MIPS. shlx and friends take the
+// count from any register, and don't touch the flags
+void CPURecompiler::EmitSLLV(Xbyak::CodeGenerator &cg)
+{
+	disasm("sllv %s, %s, %s\n", GetRegName(cur_instr.r_type.rd), GetRegName(cur_instr.r_type.rt), GetRegName(cur_instr.r_type.rs));
+
+	EmitLoadReg(cg, cg.ebx, cur_instr.r_type.rt);
+	EmitLoadReg(cg, cg.ecx, cur_instr.r_type.rs);
+
+	if (HostCPU::bmi2)
+		cg.shlx(cg.ebx, cg.ebx, cg.ecx);
+	else
+		cg.shl(cg.ebx, cg.cl);
+
+	if (cur_instr.r_type.rd)
+		EmitStoreReg(cg, cur_instr.r_type.rd, cg.ebx);
+}
+
+void CPURecompiler::EmitSRLV(Xbyak::CodeGenerator &cg)
+{
+	disasm("srlv %s, %s, %s\n", GetRegName(cur_instr.r_type.rd), GetRegName(cur_instr.r_type.rt), GetRegName(cur_instr.r_type.rs));
+
+	EmitLoadReg(cg, cg.ebx, cur_instr.r_type.rt);
+	EmitLoadReg(cg, cg.ecx, cur_instr.r_type.rs);
+
+	if (HostCPU::bmi2)
+		cg.shrx(cg.ebx, cg.ebx, cg.ecx);
+	else
+		cg.shr(cg.ebx, cg.cl);
+
+	if (cur_instr.r_type.rd)
+		EmitStoreReg(cg, cur_instr.r_type.rd, cg.ebx);
+}
+
+void CPURecompiler::EmitSRAV(Xbyak::CodeGenerator &cg)
+{
+	disasm("srav %s, %s, %s\n", GetRegName(cur_instr.r_type.rd), GetRegName(cur_instr.r_type.rt), GetRegName(cur_instr.r_type.rs));
+
+	EmitLoadReg(cg, cg.ebx, cur_instr.r_type.rt);
+	EmitLoadReg(cg, cg.ecx, cur_instr.r_type.rs);
+
+	if (HostCPU::bmi2)
+		cg.sarx(cg.ebx, cg.ebx, cg.ecx);
+	else
+		cg.sar(cg.ebx, cg.cl);
+
+	if (cur_instr.r_type.rd)
+		EmitStoreReg(cg, cur_instr.r_type.rd, cg.ebx);
+}
+
+void CPURecompiler::EmitJR(Xbyak::CodeGenerator &cg)
+{
+	disasm("jr %s (0x%08x)\n", GetRegName(cur_instr.i_type.rs), g_state.regs[cur_instr.i_type.rs]);
+
+	EmitLoadReg(cg, cg.ebx, cur_instr.i_type.rs);
+	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, next_pc)]);
+	cg.mov(cg.dword[cg.rax], cg.ebx);
+}
+
+void CPURecompiler::EmitJALR(Xbyak::CodeGenerator &cg)
+{
+	disasm("jalr %s, %s (0x%08x)\n", GetRegName(cur_instr.r_type.rd), GetRegName(cur_instr.r_type.rs), g_state.regs[cur_instr.r_type.rs]);
+
+	// Read the target first, rd and rs can be the same register
+	EmitLoadReg(cg, cg.ecx, cur_instr.r_type.rs);
+	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, next_pc)]);
+	cg.mov(cg.ebx, cg.dword[cg.rax]);
+	cg.mov(cg.dword[cg.rax], cg.ecx);
+
+	if (cur_instr.r_type.rd)
+	{
+		EmitStoreReg(cg, cur_instr.r_type.rd, cg.ebx);
+	}
+
+	EmitPushReturn(cg);
+}
+
+void CPURecompiler::EmitADDU(Xbyak::CodeGenerator &cg)
+{
+	disasm("addu %s, %s, %s\n", GetRegName(cur_instr.r_type.rd), GetRegName(cur_instr.r_type.rt), GetRegName(cur_instr.r_type.rs));
+
+	EmitLoadReg(cg, cg.ebx, cur_instr.r_type.rs);
+	EmitLoadReg(cg, cg.ecx, cur_instr.r_type.rt);
 	
 	cg.add(cg.ebx, cg.ecx);
 	
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.r_type.rd * 4)]);
+	EmitStoreReg(cg, cur_instr.r_type.rd, cg.ebx);
+}
+
+void CPURecompiler::EmitAnd(Xbyak::CodeGenerator &cg)
+{
+	disasm("and %s, %s, %s\n", GetRegName(cur_instr.r_type.rd), GetRegName(cur_instr.r_type.rt), GetRegName(cur_instr.r_type.rs));
+
+	EmitLoadReg(cg, cg.ebx, cur_instr.r_type.rs);
+	EmitLoadReg(cg, cg.ecx, cur_instr.r_type.rt);
+	
+	cg.and_(cg.ebx, cg.ecx);
+	
+	EmitStoreReg(cg, cur_instr.r_type.rd, cg.ebx);
+}
+
+void CPURecompiler::EmitOr(Xbyak::CodeGenerator &cg)
+{
+	disasm("or %s, %s, %s\n", GetRegName(cur_instr.r_type.rd), GetRegName(cur_instr.r_type.rt), GetRegName(cur_instr.r_type.rs));
+
+	EmitLoadReg(cg, cg.ebx, cur_instr.r_type.rs);
+	EmitLoadReg(cg, cg.ecx, cur_instr.r_type.rt);
+	
+	cg.or_(cg.ebx, cg.ecx);
+	
+	EmitStoreReg(cg, cur_instr.r_type.rd, cg.ebx);
+}
+
+void CPURecompiler::EmitSLTU(Xbyak::CodeGenerator &cg)
+{
+	disasm("sltu %s, %s, %s\n", GetRegName(cur_instr.r_type.rd), GetRegName(cur_instr.r_type.rt), GetRegName(cur_instr.r_type.rs));
+
+	EmitLoadReg(cg, cg.ebx, cur_instr.r_type.rs);
+	EmitLoadReg(cg, cg.ecx, cur_instr.r_type.rt);
+	cg.cmp(cg.ebx, cg.ecx);
+
+	Xbyak::Label not_less_than;
+	Xbyak::Label end;
+
+	cg.jae(not_less_than);
+	EmitStoreReg(cg, cur_instr.r_type.rd, 1);
+	cg.jmp(end);
+
+	cg.L(not_less_than);
+	EmitStoreReg(cg, cur_instr.r_type.rd, 0);
+	cg.L(end);
+}
+
+// The multiply/divide unit runs alongside the CPU. Its result is ready some cycles after the
+// instruction that starts it, and only reading it with mfhi/mflo before then stalls
+void CPURecompiler::EmitMDUBusy(Xbyak::CodeGenerator &cg, const Xbyak::Reg32 &latency)
+{
+	cg.mov(cg.rdx, cg.qword[cg.rbp + offsetof(CPUState, cycles)]);
+	cg.add(cg.rdx, (uint32_t)cur_index);
+	cg.add(cg.rdx, latency.cvt64());
+	cg.mov(cg.qword[cg.rbp + offsetof(CPUState, mdu_ready)], cg.rdx);
+}
+
+void CPURecompiler::EmitMDUWait(Xbyak::CodeGenerator &cg)
+{
+	cg.mov(cg.rax, cg.qword[cg.rbp + offsetof(CPUState, cycles)]);
+	cg.add(cg.rax, (uint32_t)cur_index);
+	cg.mov(cg.rcx, cg.qword[cg.rbp + offsetof(CPUState, mdu_ready)]);
+	cg.sub(cg.rcx, cg.rax);
+	cg.xor_(cg.edx, cg.edx);
+	cg.test(cg.rcx, cg.rcx);
+	cg.cmovs(cg.rcx, cg.rdx);
+	cg.add(cg.qword[cg.rbp + offsetof(CPUState, cycles)], cg.rcx);
+	cg.add(cg.qword[cg.rbp + offsetof(CPUState, stalls)], cg.rcx);
+}
+
+void CPURecompiler::EmitMFHI(Xbyak::CodeGenerator &cg)
+{
+	disasm("mfhi %s\n", GetRegName(cur_instr.r_type.rd));
+
+	EmitMDUWait(cg);
+
+	if (cur_instr.r_type.rd)
+	{
+		cg.mov(cg.ebx, cg.dword[cg.rbp + offsetof(CPUState, hi)]);
+		EmitStoreReg(cg, cur_instr.r_type.rd, cg.ebx);
+	}
+}
+
+void CPURecompiler::EmitMTHI(Xbyak::CodeGenerator &cg)
+{
+	disasm("mthi %s\n", GetRegName(cur_instr.r_type.rs));
+
+	EmitLoadReg(cg, cg.ebx, cur_instr.r_type.rs);
+	cg.mov(cg.dword[cg.rbp + offsetof(CPUState, hi)], cg.ebx);
+}
+
+void CPURecompiler::EmitMFLO(Xbyak::CodeGenerator &cg)
+{
+	disasm("mflo %s\n", GetRegName(cur_instr.r_type.rd));
+
+	EmitMDUWait(cg);
+
+	if (cur_instr.r_type.rd)
+	{
+		cg.mov(cg.ebx, cg.dword[cg.rbp + offsetof(CPUState, lo)]);
+		EmitStoreReg(cg, cur_instr.r_type.rd, cg.ebx);
+	}
+}
+
+void CPURecompiler::EmitMTLO(Xbyak::CodeGenerator &cg)
+{
+	disasm("mtlo %s\n", GetRegName(cur_instr.r_type.rs));
+
+	EmitLoadReg(cg, cg.ebx, cur_instr.r_type.rs);
+	cg.mov(cg.dword[cg.rbp + offsetof(CPUState, lo)], cg.ebx);
+}
+
+// Multiplies take 6, 9 or 13 cycles depending on how many significant bits rs has
+static void EmitMultLatency(Xbyak::CodeGenerator &cg, const Xbyak::Reg32 &magnitude)
+{
+	cg.mov(cg.eax, 6);
+	cg.mov(cg.ecx, 9);
+	cg.cmp(magnitude, 0x800);
+	cg.cmovae(cg.eax, cg.ecx);
+	cg.mov(cg.ecx, 13);
+	cg.cmp(magnitude, 0x100000);
+	cg.cmovae(cg.eax, cg.ecx);
+}
+
+void CPURecompiler::EmitMULT(Xbyak::CodeGenerator &cg)
+{
+	disasm("mult %s, %s\n", GetRegName(cur_instr.r_type.rs), GetRegName(cur_instr.r_type.rt));
+
+	EmitLoadReg(cg, cg.ebx, cur_instr.r_type.rs);
+	EmitLoadReg(cg, cg.ecx, cur_instr.r_type.rt);
+
+	cg.movsxd(cg.rax, cg.ebx);
+	cg.movsxd(cg.rcx, cg.ecx);
+	cg.imul(cg.rax, cg.rcx);
+	cg.mov(cg.dword[cg.rbp + offsetof(CPUState, lo)], cg.eax);
+	cg.shr(cg.rax, 32);
+	cg.mov(cg.dword[cg.rbp + offsetof(CPUState, hi)], cg.eax);
+
+	// Negative values count their leading ones instead
+	cg.mov(cg.esi, cg.ebx);
+	cg.sar(cg.esi, 31);
+	cg.xor_(cg.esi, cg.ebx);
+	EmitMultLatency(cg, cg.esi);
+	EmitMDUBusy(cg, cg.eax);
+}
+
+void CPURecompiler::EmitMULTU(Xbyak::CodeGenerator &cg)
+{
+	disasm("multu %s, %s\n", GetRegName(cur_instr.r_type.rs), GetRegName(cur_instr.r_type.rt));
+
+	// Writing a 32 bit register clears the top half, so these are already zero extended
+	EmitLoadReg(cg, cg.ebx, cur_instr.r_type.rs);
+	EmitLoadReg(cg, cg.ecx, cur_instr.r_type.rt);
+
+	cg.mov(cg.eax, cg.ebx);
+	cg.imul(cg.rax, cg.rcx);
+	cg.mov(cg.dword[cg.rbp + offsetof(CPUState, lo)], cg.eax);
+	cg.shr(cg.rax, 32);
+	cg.mov(cg.dword[cg.rbp + offsetof(CPUState, hi)], cg.eax);
+
+	EmitMultLatency(cg, cg.ebx);
+	EmitMDUBusy(cg, cg.eax);
+}
+
+// Dividing by zero doesn't trap. It leaves rs in hi, and -1 in lo (1 for a negative
+// signed rs). Dividing 0x80000000 by -1 gives 0x80000000 remainder 0, which a 64 bit
+// divide gets right without special casing it
+void CPURecompiler::EmitDIV(Xbyak::CodeGenerator &cg)
+{
+	disasm("div %s, %s\n", GetRegName(cur_instr.r_type.rs), GetRegName(cur_instr.r_type.rt));
+
+	EmitLoadReg(cg, cg.ebx, cur_instr.r_type.rs);
+	EmitLoadReg(cg, cg.esi, cur_instr.r_type.rt);
+
+	cg.movsxd(cg.rax, cg.ebx);
+	cg.movsxd(cg.rcx, cg.esi);
+	cg.mov(cg.edx, 1);
+	cg.test(cg.rcx, cg.rcx);
+	cg.cmovz(cg.rcx, cg.rdx);
+	cg.cqo();
+	cg.idiv(cg.rcx);
+
+	cg.mov(cg.edi, cg.ebx);
+	cg.sar(cg.edi, 31);
+	cg.not_(cg.edi);
+	cg.or_(cg.edi, 1);
+	cg.test(cg.esi, cg.esi);
+	cg.cmovz(cg.eax, cg.edi);
+	cg.cmovz(cg.edx, cg.ebx);
+
+	cg.mov(cg.dword[cg.rbp + offsetof(CPUState, lo)], cg.eax);
+	cg.mov(cg.dword[cg.rbp + offsetof(CPUState, hi)], cg.edx);
+
+	cg.mov(cg.eax, 36);
+	EmitMDUBusy(cg, cg.eax);
+}
+
+void CPURecompiler::EmitDIVU(Xbyak::CodeGenerator &cg)
+{
+	disasm("divu %s, %s\n", GetRegName(cur_instr.r_type.rs), GetRegName(cur_instr.r_type.rt));
+
+	EmitLoadReg(cg, cg.ebx, cur_instr.r_type.rs);
+	EmitLoadReg(cg, cg.esi, cur_instr.r_type.rt);
+
+	cg.mov(cg.eax, cg.ebx);
+	cg.mov(cg.ecx, cg.esi);
+	cg.mov(cg.edx, 1);
+	cg.test(cg.ecx, cg.ecx);
+	cg.cmovz(cg.ecx, cg.edx);
+	cg.xor_(cg.edx, cg.edx);
+	cg.div(cg.ecx);
+
+	cg.mov(cg.edi, -1);
+	cg.test(cg.esi, cg.esi);
+	cg.cmovz(cg.eax, cg.edi);
+	cg.cmovz(cg.edx, cg.ebx);
+
+	cg.mov(cg.dword[cg.rbp + offsetof(CPUState, lo)], cg.eax);
+	cg.mov(cg.dword[cg.rbp + offsetof(CPUState, hi)], cg.edx);
+
+	cg.mov(cg.eax, 36);
+	EmitMDUBusy(cg, cg.eax);
+}
+
+void CPURecompiler::EmitMFC0(Xbyak::CodeGenerator &cg)
+{
+	disasm("mfc0 r%d, %s\n", cur_instr.r_type.rd, GetRegName(cur_instr.r_type.rt));
+
+	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, cop0) + (cur_instr.r_type.rd * 4)]);
+	cg.mov(cg.ebx, cg.dword[cg.rax]);
+	EmitStoreReg(cg, cur_instr.r_type.rt, cg.ebx);
+}
+
+void CPURecompiler::EmitMTC0(Xbyak::CodeGenerator &cg)
+{
+	disasm("mtc0 r%d, %s\n", cur_instr.r_type.rd, GetRegName(cur_instr.r_type.rt));
+
+	EmitLoadReg(cg, cg.ebx, cur_instr.r_type.rt);
+	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, cop0) + (cur_instr.r_type.rd * 4)]);
 	cg.mov(cg.dword[cg.rax], cg.ebx);
 }
 
-void CPURecompiler::EmitAnd(Xbyak::CodeGenerator &cg)
+// The CPU thread can be writing RAM while the speculation thread reads code from it,
+// so those reads are atomic. That only keeps each word whole: the code can still change
+// before the block is adopted, which is what the hash check in AdoptSpeculated is for
+uint32_t CPURecompiler::ReadCode(uint32_t addr)
+{
+	uint8_t* p = Bus::GetRAM(addr, 4);
+	if (!p || !speculative)
+		return Bus::read<uint32_t>(addr);
+
+	return std::atomic_ref<uint32_t>(*reinterpret_cast<uint32_t*>(p)).load(std::memory_order_relaxed);
+}
+
+// Speculative compiles can run into anything, so they give up on code the CPU couldn't run
+bool CPURecompiler::Fetch(uint32_t pc, uint32_t& opcode)
+{
+	if (speculative && !Bus::GetRAM(pc, 4) && !Bus::IsROM(Bus::mask_region(pc)))
+		return false;
+
+	opcode = ReadCode(pc);
+	return !speculative || IsSupported(opcode);
+}
+
+HostFunc CPURecompiler::Compile(uint32_t pc, int max_instrs)
+{
+	uint32_t next_pc = pc + 4;
+	uint32_t branch_pc = 0, branch = 0;
+
+	// The speculation thread can't look at SR, and only guesses at code run with the cache on
+	isolated = speculative ? false : IsCacheIsolated();
+	if (trace_entries.count(BlockKey(Bus::mask_region(pc), isolated)))
+		tracing = true;
+	BeginBlock(pc);
+
+	for (int i = 0; i < max_instrs; i++)
+	{
+		uint32_t opcode;
+		branch_pc = pc;
+		if (!Fetch(pc, opcode))
+		{
+			ResetBlockState();
+			return nullptr;
+		}
+		pc = next_pc;
+		next_pc += 4;
+
+		bool shouldContinue = EmitInstruction(opcode);
+
+		if (!shouldContinue)
+		{
+			if (!ModifiesPC(opcode))
+				break;
+
+			// Add one more opcode for branch delay slot
+			branch = opcode;
+			if (!Fetch(pc, opcode))
+			{
+				ResetBlockState();
+				return nullptr;
+			}
+			pc = next_pc;
+			next_pc += 4;
+			EmitInstruction(opcode);
+
+			// Superblocks keep going along the likely path
+			if (!InlineCall(branch_pc, branch, pc) && !FollowBranch(branch_pc, branch, pc))
+				break;
+
+			branch = 0;
+			next_pc = pc + 4;
+			i = 0;
+		}
+	}
+
+	bool queue = branch && !isolated && !speculative && Speculate::active;
+	HostFunc func = CompileBlock();
+
+	if (queue)
+		QueueSuccessors(branch_pc, branch);
+
+	return func;
+}
+
+HostFunc CPURecompiler::CompileSpeculative(uint32_t pc, int max_instrs)
+{
+	speculative = true;
+	HostFunc func = Compile(pc, max_instrs);
+	speculative = false;
+
+	return func;
+}
+
+// Hands the blocks a branch can go to next to the speculation thread, unless they're already compiled
+void CPURecompiler::QueueSuccessors(uint32_t branch_pc, uint32_t opcode)
+{
+	Opcode o;
+	o.full = opcode;
+	uint32_t targets[2];
+	int count = 0;
+
+	switch (o.opcode)
+	{
+	case Instructions::j:
+	case Instructions::jal:
+		targets[count++] = ((branch_pc + 4) & 0xf0000000) | (o.j_type.target << 2);
+		break;
+	case Instructions::beq:
+	case Instructions::bne:
+		targets[count++] = branch_pc + 4 + ((int32_t)(int16_t)o.i_type.imm << 2);
+		break;
+	}
+
+	// Fall through for conditional branches, the return address for calls
+	if (o.opcode != Instructions::j && !(o.opcode == Instructions::special && o.r_type.func == SpecialInstructions::jr))
+		targets[count++] = branch_pc + 8;
+
+	for (int i = 0; i < count; i++)
+	{
+		if (!blockMap.count(BlockKey(Bus::mask_region(targets[i]), false)))
+			Speculate::Queue(targets[i]);
+	}
+}
+
+// The guest register an instruction writes, or 0
+static int DestReg(uint32_t i)
+{
+	Opcode o;
+	o.full = i;
+
+	switch (o.opcode)
+	{
+	case Instructions::special:
+		return o.r_type.func == SpecialInstructions::jr ? 0 : o.r_type.rd;
+	case Instructions::jal:
+		return 31;
+	case Instructions::cop0:
+		return o.r_type.rs == Cop0Instructions::mfc0 ? o.r_type.rt : 0;
+	case Instructions::j:
+	case Instructions::beq:
+	case Instructions::bne:
+	case Instructions::sb:
+	case Instructions::sh:
+	case Instructions::sw:
+	case Instructions::swl:
+	case Instructions::swr:
+		return 0;
+	default:
+		return o.i_type.rt;
+	}
+}
+
+static int AccessSize(uint32_t i)
+{
+	Opcode o;
+	o.full = i;
+
+	switch (o.opcode)
+	{
+	case Instructions::lb:
+	case Instructions::lbu:
+	case Instructions::sb:
+		return 1;
+	case Instructions::lh:
+	case Instructions::lhu:
+	case Instructions::sh:
+		return 2;
+	case Instructions::lw:
+	case Instructions::sw:
+		return 4;
+	default:
+		return 0;
+	}
+}
+
+static bool IsStore(uint32_t i)
+{
+	Opcode o;
+	o.full = i;
+	return o.opcode == Instructions::sb || o.opcode == Instructions::sh || o.opcode == Instructions::sw;
+}
+
+static void MarkDirty(uint32_t address)
+{
+	Bus::recomp->MarkBlockDirty(address);
+}
+
+// Stack frames and structs get accessed through runs of loads and stores off one base
+// register. If the base doesn't change over the run, one check that the lowest and
+// highest addresses are in RAM covers every access in it
+void CPURecompiler::FindAccessGroups()
+{
+	access_groups.clear();
+
+	// Stores go to the I-cache instead
+	if (isolated)
+		return;
+
+	size_t n = cur_instrs.size();
+
+	// Skip the first instruction, a load from the previous block lands after it
+	for (size_t start = 1; start < n; start++)
+	{
+		Opcode o;
+		o.full = cur_instrs[start];
+		int base = o.i_type.rs;
+
+		if (!AccessSize(o.full) || base == 0)
+			continue;
+
+		// Same for a load issued just before
+		if (AccessSize(cur_instrs[start - 1]) && !IsStore(cur_instrs[start - 1]) && DestReg(cur_instrs[start - 1]) == base)
+			continue;
+
+		AccessGroup group = {start, start, base, (int16_t)o.i_type.imm, (int16_t)o.i_type.imm + AccessSize(o.full) - 1};
+
+		for (size_t k = start + 1; k < n; k++)
+		{
+			Opcode a;
+			a.full = cur_instrs[k];
+
+			if (DestReg(cur_instrs[k - 1]) == base || ModifiesPC(a.full) || EndsBlock(a.full))
+				break;
+
+			// A fused pair puts its slow path in the cold code, which the group's slow copy is already in
+			if (std::find(fused_pairs.begin(), fused_pairs.end(), k) != fused_pairs.end())
+				break;
+
+			if (AccessSize(a.full) && a.i_type.rs == base)
+			{
+				group.end = k;
+				group.min = std::min(group.min, (int32_t)(int16_t)a.i_type.imm);
+				group.max = std::max(group.max, (int16_t)a.i_type.imm + AccessSize(a.full) - 1);
+			}
+		}
+
+		if (group.end != start)
+		{
+			access_groups.push_back(group);
+			start = group.end;
+		}
+	}
+}
+
+// Jumps to slow unless every address the group touches is in RAM
+void CPURecompiler::EmitGroupGuard(Xbyak::CodeGenerator &cg, const AccessGroup &group, const uint8_t* slow)
+{
+	EmitLoadReg(cg, cg.eax, group.base);
+	cg.add(cg.eax, group.min);
+
+	// RAM is only mapped in KUSEG, KSEG0 and KSEG1
+	cg.mov(cg.ecx, cg.eax);
+	cg.shr(cg.ecx, 29);
+	cg.mov(cg.edx, 0x31);
+	cg.bt(cg.edx, cg.ecx);
+	cg.jnc(slow);
+
+	cg.and_(cg.eax, 0x1FFFFFFF);
+	cg.cmp(cg.eax, 0x200000 - (group.max - group.min + 1));
+	cg.ja(slow);
+}
+
+// Access Bus::ram directly, for an access in a group whose guard passed
+bool CPURecompiler::EmitFastAccess(Xbyak::CodeGenerator &cg)
+{
+	if (!fast_base || cur_instr.i_type.rs != fast_base)
+		return false;
+
+	EmitLoadReg(cg, cg.eax, fast_base);
+	cg.add(cg.eax, (int32_t)(int16_t)cur_instr.i_type.imm);
+	cg.and_(cg.eax, 0x1FFFFF);
+	cg.mov(cg.rdx, reinterpret_cast<uint64_t>(Bus::ram));
+
+	if (IsStore(cur_instr.full))
+	{
+		EmitLoadReg(cg, cg.esi, cur_instr.i_type.rt);
+		switch (cur_instr.opcode)
+		{
+		case Instructions::sb:
+			cg.mov(cg.byte[cg.rdx + cg.rax], cg.sil);
+			break;
+		case Instructions::sh:
+			cg.mov(cg.word[cg.rdx + cg.rax], cg.si);
+			break;
+		default:
+			cg.mov(cg.dword[cg.rdx + cg.rax], cg.esi);
+			break;
+		}
+
+		const uint8_t* dirty = cold->getCurr();
+		cold->mov(cold->edi, cold->eax);
+		EmitCall(*cold, reinterpret_cast<const void*>(MarkDirty));
+		uint8_t* back = EmitJumpBack();
+
+		cg.mov(cg.ecx, cg.eax);
+		cg.shr(cg.ecx, 12);
+		cg.mov(cg.rdx, reinterpret_cast<uint64_t>(code_pages));
+		cg.cmp(cg.word[cg.rdx + cg.rcx * 2], 0);
+		cg.jne(dirty);
+		BindJumpBack(cg, back);
+
+		return true;
+	}
+
+	switch (cur_instr.opcode)
+	{
+	case Instructions::lb:
+		cg.movsx(cg.ebx, cg.byte[cg.rdx + cg.rax]);
+		break;
+	case Instructions::lbu:
+		cg.movzx(cg.ebx, cg.byte[cg.rdx + cg.rax]);
+		break;
+	case Instructions::lh:
+		cg.movsx(cg.ebx, cg.word[cg.rdx + cg.rax]);
+		break;
+	case Instructions::lhu:
+		cg.movzx(cg.ebx, cg.word[cg.rdx + cg.rax]);
+		break;
+	default:
+		cg.mov(cg.ebx, cg.dword[cg.rdx + cg.rax]);
+		break;
+	}
+
+	cg.mov(cg.rax, reinterpret_cast<uint64_t>(&next_load_delay));
+	cg.mov(cg.dword[cg.rax + offsetof(LoadDelaySlot, reg)], cur_instr.i_type.rt);
+	cg.mov(cg.dword[cg.rax + offsetof(LoadDelaySlot, data)], cg.ebx);
+
+	return true;
+}
+
+static bool IsLoad(uint32_t i)
+{
+	Opcode o;
+	o.full = i;
+	return (AccessSize(i) && !IsStore(i)) || o.opcode == Instructions::lwl || o.opcode == Instructions::lwr;
+}
+
+// Unaligned words get accessed with lwl and lwr (or swl and swr) on the same register,
+// the left one 3 bytes above the right one. Next to each other they make a whole word
+void CPURecompiler::FindUnalignedPairs()
+{
+	fused_pairs.clear();
+
+	size_t n = cur_instrs.size();
+
+	for (size_t i = 1; i + 2 < n; i++)
+	{
+		Opcode a, b;
+		a.full = cur_instrs[i];
+		b.full = cur_instrs[i + 1];
+
+		bool loads = (a.opcode == Instructions::lwl && b.opcode == Instructions::lwr) || (a.opcode == Instructions::lwr && b.opcode == Instructions::lwl);
+		bool stores = (a.opcode == Instructions::swl && b.opcode == Instructions::swr) || (a.opcode == Instructions::swr && b.opcode == Instructions::swl);
+
+		if (!loads && !stores)
+			continue;
+		if (a.i_type.rt != b.i_type.rt || a.i_type.rs != b.i_type.rs)
+			continue;
+
+		bool a_left = a.opcode == Instructions::lwl || a.opcode == Instructions::swl;
+		int16_t left = a_left ? a.i_type.imm : b.i_type.imm;
+		int16_t right = a_left ? b.i_type.imm : a.i_type.imm;
+		if (left != right + 3)
+			continue;
+
+		// Both halves have to see the same base and value, which a load just before could change
+		Opcode prev;
+		prev.full = cur_instrs[i - 1];
+		if (IsLoad(prev.full) && (prev.i_type.rt == a.i_type.rs || prev.i_type.rt == a.i_type.rt))
+			continue;
+
+		if (std::any_of(trace_exits.begin(), trace_exits.end(), [i](auto& e) { return e.first == i; }))
+			continue;
+
+		if (stores && isolated)
+			continue;
+
+		// Half the word is in rt for the instruction after the pair, so that can't read it
+		if (loads)
+		{
+			Opcode next;
+			next.full = cur_instrs[i + 2];
+			if (a.i_type.rt == 0 || a.i_type.rt == a.i_type.rs || next.i_type.rs == a.i_type.rt || next.i_type.rt == a.i_type.rt)
+				continue;
+		}
+
+		fused_pairs.push_back(i);
+		i++;
+	}
+}
+
+// The whole access for a fused pair, as one host access when the word is in RAM
+void CPURecompiler::EmitFusedUnaligned(Xbyak::CodeGenerator &cg, size_t index)
+{
+	Opcode first;
+	first.full = cur_instrs[index - 1];
+	int16_t right = std::min<int16_t>(first.i_type.imm, cur_instr.i_type.imm);
+	bool load = cur_instr.opcode == Instructions::lwl || cur_instr.opcode == Instructions::lwr;
+
+	disasm("%s %s, %d(%s) (fused)\n", load ? "lw" : "sw", GetRegName(cur_instr.i_type.rt), right, GetRegName(cur_instr.i_type.rs));
+
+	// Slow paths go in the cold code and come back after the access
+	const uint8_t* slow = cold->getCurr();
+	EmitCall(*cold, load ? reinterpret_cast<const void*>(LoadUnaligned) : reinterpret_cast<const void*>(StoreUnaligned));
+	if (load)
+		cold->mov(cold->ebx, cold->eax);
+	uint8_t* slow_back = EmitJumpBack();
+
+	const uint8_t* dirty = cold->getCurr();
+	uint8_t* dirty_back = nullptr;
+	if (!load)
+	{
+		cold->mov(cold->edi, cold->eax);
+		EmitCall(*cold, reinterpret_cast<const void*>(MarkWordDirty));
+		dirty_back = EmitJumpBack();
+	}
+
+	EmitLoadReg(cg, cg.edi, cur_instr.i_type.rs);
+	cg.add(cg.edi, (int32_t)right);
+	if (!load)
+		EmitLoadReg(cg, cg.esi, cur_instr.i_type.rt);
+
+	// RAM is only mapped in KUSEG, KSEG0 and KSEG1
+	cg.mov(cg.eax, cg.edi);
+	cg.mov(cg.ecx, cg.eax);
+	cg.shr(cg.ecx, 29);
+	cg.mov(cg.edx, 0x31);
+	cg.bt(cg.edx, cg.ecx);
+	cg.jnc(slow);
+	cg.and_(cg.eax, 0x1FFFFFFF);
+	cg.cmp(cg.eax, 0x200000 - 4);
+	cg.ja(slow);
+
+	cg.mov(cg.rdx, reinterpret_cast<uint64_t>(Bus::ram));
+
+	if (load)
+	{
+		cg.mov(cg.ebx, cg.dword[cg.rdx + cg.rax]);
+		BindJumpBack(cg, slow_back);
+
+		cg.mov(cg.rax, reinterpret_cast<uint64_t>(&next_load_delay));
+		cg.mov(cg.dword[cg.rax + offsetof(LoadDelaySlot, reg)], cur_instr.i_type.rt);
+		cg.mov(cg.dword[cg.rax + offsetof(LoadDelaySlot, data)], cg.ebx);
+		return;
+	}
+
+	cg.mov(cg.dword[cg.rdx + cg.rax], cg.esi);
+
+	// The word can straddle two pages
+	cg.mov(cg.rdx, reinterpret_cast<uint64_t>(code_pages));
+	cg.mov(cg.ecx, cg.eax);
+	cg.shr(cg.ecx, 12);
+	cg.cmp(cg.word[cg.rdx + cg.rcx * 2], 0);
+	cg.jne(dirty);
+	cg.lea(cg.ecx, cg.ptr[cg.rax + 3]);
+	cg.shr(cg.ecx, 12);
+	cg.cmp(cg.word[cg.rdx + cg.rcx * 2], 0);
+	cg.jne(dirty);
+
+	BindJumpBack(cg, slow_back);
+	BindJumpBack(cg, dirty_back);
+}
+
+bool CPURecompiler::IsSelfLoop()
+{
+	size_t n = cur_instrs.size();
+	if (n < 2 || !trace_exits.empty())
+		return false;
+
+	Opcode o;
+	o.full = cur_instrs[n - 2];
+	uint32_t branch = cur_addrs[n - 2];
+
+	switch (o.opcode)
+	{
+	case Instructions::beq:
+	case Instructions::bne:
+		return branch + 4 + ((int32_t)(int16_t)o.i_type.imm << 2) == cur_addrs.front();
+	case Instructions::j:
+		return Bus::mask_region(((branch + 4) & 0xf0000000) | (o.j_type.target << 2)) == cur_addrs.front();
+	default:
+		return false;
+	}
+}
+
+void CPURecompiler::AssignLoopRegs()
+{
+	int uses[32] = {};
+
+	for (auto i : cur_instrs)
+	{
+		Opcode o;
+		o.full = i;
+		uses[o.r_type.rs]++;
+		uses[o.r_type.rt]++;
+		uses[o.r_type.rd]++;
+	}
+
+	for (auto i : cur_instrs)
+	{
+		Opcode o;
+		o.full = i;
+
+		switch (o.opcode)
+		{
+		case Instructions::lb:
+		case Instructions::lh:
+		case Instructions::lw:
+		case Instructions::lbu:
+		case Instructions::lhu:
+		case Instructions::lwl:
+		case Instructions::lwr:
+			uses[o.i_type.rt] = 0;
+			break;
+		}
+	}
+
+	uses[0] = 0;
+
+	const int hosts[] = {12, 13, 14};
+	for (int host : hosts)
+	{
+		int best = std::max_element(uses, uses + 32) - uses;
+		if (!uses[best])
+			break;
+
+		loop_regs[best] = host;
+		uses[best] = 0;
+	}
+}
+
+// Called after the first pass through a self-loop. If it's going round again, load the
+// registers it uses into host registers and run a second copy of the body that jumps
+// back to its own start until the branch falls through or the deadline passes
+void CPURecompiler::EmitLoop(Xbyak::CodeGenerator &cg, bool chain)
+{
+	Xbyak::Label done, stop, loop_head, leave_loop;
+	uint32_t n = cur_instrs.size();
+
+	cg.cmp(cg.dword[cg.rbp + offsetof(CPUState, pc)], cg.r15d);
+	cg.jne(done, cg.T_NEAR);
+
+	cg.add(cg.qword[cg.rbp + offsetof(CPUState, cycles)], n);
+	cg.mov(cg.rax, reinterpret_cast<uint64_t>(&cycle_deadline));
+	cg.mov(cg.rax, cg.qword[cg.rax]);
+	cg.cmp(cg.qword[cg.rbp + offsetof(CPUState, cycles)], cg.rax);
+	cg.jae(stop, cg.T_NEAR);
+
+	// r12 has held the generation since the block was entered. Push it twice to keep
+	// the stack aligned for calls
+	cg.mov(cg.rax, reinterpret_cast<uint64_t>(&generation));
+	cg.cmp(cg.r12d, cg.dword[cg.rax]);
+	cg.jne(stop, cg.T_NEAR);
+	cg.push(cg.r12);
+	cg.push(cg.r12);
+
+	AssignLoopRegs();
+	for (int r = 1; r < 32; r++)
+	{
+		if (loop_regs[r])
+			cg.mov(Xbyak::Reg32(loop_regs[r]), cg.dword[cg.rbp + offsetof(CPUState, regs) + (r * 4)]);
+	}
+
+	cg.L(loop_head);
+	std::vector<const uint8_t*> no_exits;
+	EmitBody(cg, no_exits);
+	cg.add(cg.qword[cg.rbp + offsetof(CPUState, cycles)], n);
+
+	cg.cmp(cg.dword[cg.rbp + offsetof(CPUState, pc)], cg.r15d);
+	cg.jne(leave_loop, cg.T_NEAR);
+	cg.mov(cg.rax, reinterpret_cast<uint64_t>(&cycle_deadline));
+	cg.mov(cg.rax, cg.qword[cg.rax]);
+	cg.cmp(cg.qword[cg.rbp + offsetof(CPUState, cycles)], cg.rax);
+	cg.jae(leave_loop, cg.T_NEAR);
+
+	// A store in the loop may have removed this block, or one it would chain to
+	cg.mov(cg.rax, reinterpret_cast<uint64_t>(&generation));
+	cg.mov(cg.eax, cg.dword[cg.rax]);
+	cg.cmp(cg.eax, cg.dword[cg.rsp]);
+	cg.jne(leave_loop, cg.T_NEAR);
+	cg.jmp(loop_head, cg.T_NEAR);
+
+	cg.L(leave_loop);
+	for (int r = 1; r < 32; r++)
+	{
+		if (loop_regs[r])
+			cg.mov(cg.dword[cg.rbp + offsetof(CPUState, regs) + (r * 4)], Xbyak::Reg32(loop_regs[r]));
+		loop_regs[r] = 0;
+	}
+	cg.add(cg.rsp, 16);
+	EmitExit(cg, chain, false);
+
+	cg.L(stop);
+	EmitSequel(cg);
+
+	cg.L(done);
+}
+
+// Emit every instruction in the block once, with a side exit after each trace exit's delay slot
+void CPURecompiler::EmitBody(Xbyak::CodeGenerator &cg, std::vector<const uint8_t*> &exits)
+{
+	ResetConsts();
+	int delayed_reg = 0;
+	size_t next_exit = 0;
+	auto group = access_groups.begin();
+
+	for (size_t index = 0; index < cur_instrs.size(); index++)
+	{
+		if (group == access_groups.end() || group->start != index)
+		{
+			EmitStep(cg, index, delayed_reg, next_exit, exits);
+			continue;
+		}
+
+		// The group runs twice over, once with direct RAM accesses behind a single
+		// guard and once through the bus. Both start from the same compile-time state.
+		// The copy through the bus goes in the cold code
+		bool known[32];
+		uint32_t value[32];
+		memcpy(known, const_known, sizeof(known));
+		memcpy(value, const_value, sizeof(value));
+		int group_delayed_reg = delayed_reg;
+		size_t group_next_exit = next_exit;
+
+		const uint8_t* slow = cold->getCurr();
+		for (size_t k = group->start; k <= group->end; k++)
+			EmitStep(*cold, k, delayed_reg, next_exit, exits);
+		uint8_t* join = EmitJumpBack();
+
+		memcpy(const_known, known, sizeof(known));
+		memcpy(const_value, value, sizeof(value));
+		delayed_reg = group_delayed_reg;
+		next_exit = group_next_exit;
+
+		EmitGroupGuard(cg, *group, slow);
+		fast_base = group->base;
+		for (size_t k = group->start; k <= group->end; k++)
+			EmitStep(cg, k, delayed_reg, next_exit, exits);
+		fast_base = 0;
+
+		BindJumpBack(cg, join);
+		index = group->end;
+		group++;
+	}
+}
+
+void CPURecompiler::EmitStep(Xbyak::CodeGenerator &cg, size_t index, int &delayed_reg, size_t &next_exit, std::vector<const uint8_t*> &exits)
+{
+	cur_instr.full = cur_instrs[index];
+	cur_index = index;
+	cur_addr = cur_addrs[index];
+	cur_inlined = std::find(inlined.begin(), inlined.end(), index) != inlined.end();
+
+	EmitIncPC(cg);
+
+	bool fused_first = std::find(fused_pairs.begin(), fused_pairs.end(), index) != fused_pairs.end();
+	bool fused_second = index > 0 && std::find(fused_pairs.begin(), fused_pairs.end(), index - 1) != fused_pairs.end();
+
+	if (cur_instr.full == 0)
+	{
+		disasm("nop\n");
+		cg.nop();
+	}
+	else if (fused_first)
+	{
+		disasm("(fused with the next instruction)\n");
+	}
+	else if (fused_second)
+	{
+		EmitFusedUnaligned(cg, index);
+	}
+	else
+	{
+		switch (cur_instr.opcode)
+		{
+		case Instructions::special:
+		{
+			switch (cur_instr.r_type.func)
+			{
+			case SpecialInstructions::sll:
+				EmitSLL(cg);
+				break;
+			case SpecialInstructions::srl:
+				EmitSRL(cg);
+				break;
+			case SpecialInstructions::sra:
+				EmitSRA(cg);
+				break;
+			case SpecialInstructions::sllv:
+				EmitSLLV(cg);
+				break;
+			case SpecialInstructions::srlv:
+				EmitSRLV(cg);
+				break;
+			case SpecialInstructions::srav:
+				EmitSRAV(cg);
+				break;
+			case SpecialInstructions::jr:
+				EmitJR(cg);
+				break;
+			case SpecialInstructions::jalr:
+				EmitJALR(cg);
+				break;
+			case SpecialInstructions::mfhi:
+				EmitMFHI(cg);
+				break;
+			case SpecialInstructions::mthi:
+				EmitMTHI(cg);
+				break;
+			case SpecialInstructions::mflo:
+				EmitMFLO(cg);
+				break;
+			case SpecialInstructions::mtlo:
+				EmitMTLO(cg);
+				break;
+			case SpecialInstructions::mult:
+				EmitMULT(cg);
+				break;
+			case SpecialInstructions::multu:
+				EmitMULTU(cg);
+				break;
+			case SpecialInstructions::div_:
+				EmitDIV(cg);
+				break;
+			case SpecialInstructions::divu:
+				EmitDIVU(cg);
+				break;
+			case SpecialInstructions::addu:
+				EmitADDU(cg);
+				break;
+			case SpecialInstructions::and_:
+				EmitAnd(cg);
+				break;
+			case SpecialInstructions::or_:
+				EmitOr(cg);
+				break;
+			case SpecialInstructions::sltiu:
+				EmitSLTU(cg);
+				break;
+			default:
+				printf("Unknown special instruction 0x%02x (0x%08x)\n", cur_instr.r_type.func, cur_instr.full);
+				exit(1);
+			}
+			break;
+		}
+		case Instructions::jal:
+			EmitJAL(cg);
+			break;
+		case Instructions::j:
+			EmitJ(cg);
+			break;
+		case Instructions::beq:
+			EmitBEQ(cg);
+			break;
+		case Instructions::bne:
+			EmitBNE(cg);
+			break;
+		case Instructions::addi:
+		case Instructions::addiu:
+			EmitAddiu(cg);
+			break;
+		case Instructions::andi:
+			EmitANDI(cg);
+			break;
+		case Instructions::ori:
+			EmitORI(cg);
+			break;
+		case Instructions::lui:
+			EmitLUI(cg);
+			break;
+		case Instructions::cop0:
+		{
+			switch (cur_instr.r_type.rs)
+			{
+			case Cop0Instructions::mfc0:
+				EmitMFC0(cg);
+				break;
+			case Cop0Instructions::mtc0:
+				EmitMTC0(cg);
+				break;
+			default:
+				printf("Unknown cop0 instruction 0x%02x (0x%08x)\n", cur_instr.r_type.rs, cur_instr.full);
+				exit(1);
+			}
+			break;
+		}
+		case Instructions::lb:
+			EmitLB(cg);
+			break;
+		case Instructions::lh:
+			EmitLH(cg);
+			break;
+		case Instructions::lbu:
+			EmitLBU(cg);
+			break;
+		case Instructions::lhu:
+			EmitLHU(cg);
+			break;
+		case Instructions::lw:
+			EmitLW(cg);
+			break;
+		case Instructions::sb:
+			EmitSB(cg);
+			break;
+		case Instructions::sh:
+			EmitSH(cg);
+			break;
+		case Instructions::sw:
+			EmitSW(cg);
+			break;
+		case Instructions::lwl:
+			EmitLWL(cg);
+			break;
+		case Instructions::lwr:
+			EmitLWR(cg);
+			break;
+		case Instructions::swl:
+			EmitSWL(cg);
+			break;
+		case Instructions::swr:
+			EmitSWR(cg);
+			break;
+		default:
+			printf("Unknown instruction 0x%02x (0x%08x)\n", cur_instr.opcode, cur_instr.full);
+			exit(1);
+		}
+	}
+
+	EmitHandleLoadDelay(cg);
+
+	UpdateConsts(delayed_reg);
+
+	// A load left pending by the previous block lands after our first instruction and
+	// wins over whatever it wrote. We can't tell which register that is, so forget them all
+	if (index == 0)
+		ResetConsts();
+
+	if (next_exit < trace_exits.size() && trace_exits[next_exit].first == index)
+	{
+		EmitTraceExit(cg, trace_exits[next_exit].second, exits[next_exit]);
+		next_exit++;
+	}
+}
+
+static uint64_t HashWords(uint64_t h, const uint32_t* words, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		h = (h ^ words[i]) * 0x9e3779b97f4a7c15;
+		h ^= h >> 29;
+	}
+
+	return h;
+}
+
+uint64_t CPURecompiler::HashRanges(const std::vector<GuestRange>& ranges)
+{
+	uint64_t h = 0;
+	for (auto& r : ranges)
+	{
+		const uint8_t* code = Bus::IsROM(r.start) ? &Bus::bios[r.start - 0x1fc00000] : &Bus::ram[r.start];
+		h = HashWords(h, reinterpret_cast<const uint32_t*>(code), r.size / 4);
+	}
+
+	return h;
+}
+
+HostFunc CPURecompiler::CompileBlock()
+{
+	disasm("-----------------------------------\n");
+
+	// Generated code only ever uses the PC values in g_state, never the ones seen here,
+	// so a block can be shared by every segment that mirrors its physical address
+	uint32_t phys = cur_addrs.front();
+	bool rom = Bus::IsROM(phys);
+
+	// Copy and fill loops get a bulk path in front of the guest code
+	LoopIdiom idiom;
+	bool contiguous = cur_addrs.back() - cur_addrs.front() == (cur_addrs.size() - 1) * 4;
+	bool has_idiom = !isolated && contiguous && LoopIdioms::Detect(cur_instrs, idiom);
+	uint32_t cold_size = 16;
+	if (has_idiom)
+	{
+		cur_size += 45;
+		cold_size += sizeof(LoopIdiom);
+	}
+
+	FindUnalignedPairs();
+	FindAccessGroups();
+	uint32_t body_cold = 0;
+	for (auto& g : access_groups)
+	{
+		cur_size += 50 + (g.end - g.start + 1) * 200;
+		body_cold += (g.end - g.start + 1) * 200;
+	}
+	body_cold += fused_pairs.size() * 60;
+	body_cold += std::count_if(cur_instrs.begin(), cur_instrs.end(), IsStore) * 30;
+
+	// Self-loops emit the body twice, slow paths and all
+	bool loop = IsSelfLoop();
+	if (loop)
+		cur_size += cur_size + 200; // For the second copy of the body, and the loop around it
+	cold_size += loop ? body_cold * 2 : body_cold;
+
+	cur_size += 10; // For rewriting a constant after the first instruction
+	cur_size += 30; // For the extra registers in the prequel and sequel
+	cur_size += trace_exits.size() * 20;
+	cur_size += 130 + 50; // For chaining out of the block, and predicting a return
+	if (!trace_exits.empty())
+		cold_size += 130 + trace_exits.size() * 20;
+	if (!tracing)
+		cur_size += 30 * std::count_if(cur_instrs.begin(), cur_instrs.end(), [](uint32_t i)
+		{
+			Opcode o;
+			o.full = i;
+			return o.opcode == Instructions::beq || o.opcode == Instructions::bne;
+		});
+	// The speculation thread leaves eviction to the CPU thread, when it adopts the block
+	cache_mutex.lock();
+	if (!rom && !speculative)
+		CheckCacheFull();
+	void* buffer = AllocBlock(base, cur_size);
+	void* cold_buffer = AllocBlock(cold_base, cold_size);
+	cache_mutex.unlock();
+
+	instructions = 0;
+
+	cur_ranges.clear();
+	for (auto addr : cur_addrs)
+	{
+		if (!cur_ranges.empty() && cur_ranges.back().start + cur_ranges.back().size == addr)
+			cur_ranges.back().size += 4;
+		else
+			cur_ranges.push_back({addr, 4});
+	}
+	uint8_t flags = (rom ? block_rom : 0) | (isolated ? block_isolated : 0) | (tracing ? block_superblock : 0);
+	uint64_t hash = HashWords(0, cur_instrs.data(), cur_instrs.size());
+
+	BlockAssembler& cg = hot_asm;
+	BlockAssembler& cold_cg = cold_asm;
+	cg.Retarget(buffer, cur_size);
+	cold_cg.Retarget(cold_buffer, cold_size);
+	cold = &cold_cg;
+
+	// The idiom lives with the code, so it goes away when the block does
+	const uint8_t* idiom_data = cold->getCurr();
+	if (has_idiom)
+		cold->db(reinterpret_cast<const uint8_t*>(&idiom), sizeof(LoopIdiom));
+
+	// Side exits count the instructions run up to them, then leave like the end of the block
+	std::vector<const uint8_t*>& exits = side_exits;
+	exits.clear();
+	if (!trace_exits.empty())
+	{
+		Xbyak::Label dispatch;
+
+		for (size_t e = 0; e < trace_exits.size(); e++)
+		{
+			exits.push_back(cold->getCurr());
+			cold->add(cold->qword[cold->rbp + offsetof(CPUState, cycles)], (uint32_t)trace_exits[e].first + 1);
+			cold->jmp(dispatch, cold->T_NEAR);
+		}
+
+		cold->L(dispatch);
+		EmitExit(*cold, true, false);
+	}
+
+	EmitPrequel(cg);
+
+	if (has_idiom)
+	{
+		disasm("Loop idiom: %s of %d byte elements\n", idiom.copy ? "copy" : "fill", idiom.size);
+
+		Xbyak::Label guest_loop;
+		cg.mov(cg.rdi, reinterpret_cast<uint64_t>(idiom_data));
+		EmitCall(cg, reinterpret_cast<const void*>(LoopIdioms::Run));
+		cg.test(cg.al, cg.al);
+		cg.jz(guest_loop);
+		EmitSequel(cg);
+		cg.L(guest_loop);
+	}
+
+	// Lets EmitLoop tell whether the first pass removed any blocks
+	if (loop)
+	{
+		cg.mov(cg.rax, reinterpret_cast<uint64_t>(&generation));
+		cg.mov(cg.r12d, cg.dword[cg.rax]);
+	}
+
+	EmitBody(cg, exits);
+
+	// Writing SR can change which blocks are valid, so that goes back to the dispatcher
+	size_t n = cur_instrs.size();
+	Opcode last;
+	last.full = n >= 2 ? cur_instrs[n - 2] : 0;
+	bool chain = !EndsBlock(cur_instrs.back());
+	bool returns = last.opcode == Instructions::special && last.r_type.func == SpecialInstructions::jr && last.r_type.rs == 31 &&
+		std::find(inlined.begin(), inlined.end(), n - 2) == inlined.end();
+
+	if (loop)
+		EmitLoop(cg, chain);
+
+	cg.add(cg.qword[cg.rbp + offsetof(CPUState, cycles)], (uint32_t)n);
+	EmitExit(cg, chain, returns);
+
+	// The sizes above are estimates, so hand back what wasn't used
+	ShrinkBlock(buffer, cg.getSize());
+	ShrinkBlock(cold_buffer, cold_cg.getSize());
+	cold = nullptr;
+
+	// static int num_bins = 0;
+	// printf("%d\n", num_bins);
+	// std::string fname = "blocks/out" + std::to_string(num_bins++) + ".bin";
+
+	// std::ofstream file(fname);
+
+	// for (int i = 0; i < cur_size; i++)
+	// {
+	// 	file << cg.getCode()[i];
+	// }
+
+	ResetBlockState();
+
+	// Only publish the block once its code is complete
+	cache_mutex.lock();
+	if (speculative)
+	{
+		speculated.push_back({(uint8_t*)buffer, (uint8_t*)cold_buffer, phys, flags, hash, cur_ranges});
+		cache_mutex.unlock();
+		return (HostFunc)buffer;
+	}
+
+	auto existing = blockMap.find(BlockKey(phys, isolated));
+	if (existing != blockMap.end())
+		RemoveBlock(existing->second);
+	PublishBlock((uint8_t*)buffer, (uint8_t*)cold_buffer, phys, flags, hash, cur_ranges);
+	cache_mutex.unlock();
+
+	return (HostFunc)buffer;
+}
+
+void CPURecompiler::ResetBlockState()
+{
+	cur_size = 25;
+	cur_instrs.clear();
+	cur_addrs.clear();
+	trace_exits.clear();
+	tracing = false;
+	inlined.clear();
+	inline_return = 0;
+	access_groups.clear();
+	fused_pairs.clear();
+}
+
+CPURecompiler::BlockHandle CPURecompiler::PublishBlock(uint8_t* code, uint8_t* cold, uint32_t phys, uint8_t flags, uint64_t hash, const std::vector<GuestRange>& ranges)
+{
+	BlockHandle block = blocks.Alloc();
+	blocks.code[block] = code;
+	blocks.cold[block] = cold;
+	blocks.guest_addr[block] = phys;
+	blocks.hits[block] = 1;
+	blocks.flags[block] = flags;
+	blocks.lo[block] = ranges.front().start;
+	blocks.hi[block] = ranges.front().start + ranges.front().size;
+	for (auto& r : ranges)
+	{
+		blocks.lo[block] = std::min(blocks.lo[block], r.start);
+		blocks.hi[block] = std::max(blocks.hi[block], r.start + r.size);
+		stats.compiled_instrs += r.size / 4;
+	}
+	blocks.ranges[block].assign(ranges.begin(), ranges.end());
+	blocks.hash[block] = hash;
+	stats.compiled++;
+
+	blockMap[BlockKey(phys, flags & block_isolated)] = block;
+	if (!(flags & block_rom))
+	{
+		blockCache.push_back(block);
+		CountCodePages(block, 1);
+	}
+
+	return block;
+}
+
+// Speculated blocks are only published from the CPU thread, which is the one
+// writing guest memory, so checking their code is still current can't race
+void CPURecompiler::AdoptSpeculated()
+{
+	cache_mutex.lock();
+	for (auto& b : speculated)
+	{
+		// Dropped if the CPU got there first, or the code changed since it was read
+		if (blockMap.count(BlockKey(b.phys, false)) || HashRanges(b.ranges) != b.hash)
+		{
+			FreeBlock(b.code);
+			FreeBlock(b.cold);
+			continue;
+		}
+
+		if (!(b.flags & block_rom))
+			CheckCacheFull();
+		PublishBlock(b.code, b.cold, b.phys, b.flags, b.hash, b.ranges);
+	}
+	speculated.clear();
+	cache_mutex.unlock();
+}
+
+HostFunc CPURecompiler::LookupBlock(uint32_t pc)
+{
+	bool isc = IsCacheIsolated();
+	stats.lookups++;
+	if (isc != links_isolated)
+	{
+		FlushLinks();
+		links_isolated = isc;
+	}
+
+	auto it = blockMap.find(BlockKey(Bus::mask_region(pc), isc));
+
+	if (it == blockMap.end() && Speculate::active)
+	{
+		AdoptSpeculated();
+		it = blockMap.find(BlockKey(Bus::mask_region(pc), isc));
+	}
+
+	if (it == blockMap.end())
+	{
+		HostFunc revived = ReviveBlock(Bus::mask_region(pc), isc);
+		stats.hits += revived != nullptr;
+		return revived;
+	}
+
+	BlockHandle b = it->second;
+	blocks.hits[b]++;
+
+	// Once a block is hot, recompile it as a superblock following the paths
+	// its branches have been taking
+	bool superblock = blocks.flags[b] & block_superblock;
+	if (!superblock && blocks.hits[b] >= 64)
+	{
+		RemoveBlock(b);
+		tracing = true;
+		return nullptr;
+	}
+
+	// Blocks still being profiled keep coming back here so their hits are counted
+	if (superblock)
+		LinkBlock(pc, b);
+
+	stats.hits++;
+	return blocks.Entry(b);
+}
+
+void CPURecompiler::LinkBlock(uint32_t pc, BlockHandle b)
+{
+	// Calls into the BIOS have to reach the dispatcher for HLE to see them
+	uint32_t addr = blocks.guest_addr[b];
+	if (addr == 0xA0 || addr == 0xB0 || addr == 0xC0)
+		return;
+
+	jump_cache[(pc >> 2) & (jump_cache_size - 1)] = {pc, blocks.Entry(b)};
+}
+
+void CPURecompiler::UnlinkBlock(BlockHandle b)
+{
+	HostFunc entry = blocks.Entry(b);
+
+	// LinkBlock only puts a block in the slot for its own address, which every
+	// mirror of that address shares
+	BlockLink& link = jump_cache[(blocks.guest_addr[b] >> 2) & (jump_cache_size - 1)];
+	if (link.host == entry)
+		link = {0, nullptr};
+
+	for (auto& l : return_stack)
+	{
+		if (l.host == entry)
+			l = {0, nullptr};
+	}
+}
+
+void CPURecompiler::FlushLinks()
+{
+	for (auto& l : jump_cache)
+		l = {0, nullptr};
+	for (auto& l : return_stack)
+		l = {0, nullptr};
+}
+
+void CPURecompiler::MarkBlockDirty(uint32_t address)
+{
+	// Only RAM blocks can be invalidated
+	if (address >= 0x200000 || !code_pages[address >> 12])
+		return;
+
+	// Blocks can overlap when code jumps into the middle of an existing block,
+	// so every block covering the address has to go
+	for (size_t i = 0; i < blockCache.size();)
+	{
+		if (Overlaps(blockCache[i], address, 1))
+			RetireBlock(blockCache[i]);
+		else
+			i++;
+	}
+}
+
+// Same as MarkBlockDirty, for writes done natively instead of through the bus
+void CPURecompiler::MarkRangeDirty(uint32_t address, uint32_t size)
+{
+	for (size_t i = 0; i < blockCache.size();)
+	{
+		if (Overlaps(blockCache[i], address, size))
+			RetireBlock(blockCache[i]);
+		else
+			i++;
+	}
+}
+
+bool CPURecompiler::Overlaps(BlockHandle b, uint32_t address, uint32_t size)
+{
+	if (blocks.lo[b] >= address + size || blocks.hi[b] <= address)
+		return false;
+
+	for (auto& r : blocks.ranges[b])
+	{
+		if (r.start < address + size && r.start + r.size > address)
+			return true;
+	}
+
+	return false;
+}
+
+// Makes the block unreachable, without freeing its code
+void CPURecompiler::DetachBlock(BlockHandle b)
 {
-	printf("and %s, %s, %s\n", GetRegName(cur_instr.r_type.rd), GetRegName(cur_instr.r_type.rt), GetRegName(cur_instr.r_type.rs));
+	UnlinkBlock(b);
+	generation++;
+	uint8_t flags = blocks.flags[b];
+	if (!(flags & block_rom))
+		CountCodePages(b, -1);
+	blockMap.erase(BlockKey(blocks.guest_addr[b], flags & block_isolated));
+
+	auto it = std::find(blockCache.begin(), blockCache.end(), b);
+	if (it != blockCache.end())
+		blockCache.erase(it);
+}
 
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.r_type.rs * 4)]);
-	cg.mov(cg.ebx, cg.dword[cg.rax]);
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.r_type.rt * 4)]);
-	cg.mov(cg.ecx, cg.dword[cg.rax]);
-	
-	cg.and_(cg.ebx, cg.ecx);
-	
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.r_type.rd * 4)]);
-	cg.mov(cg.dword[cg.rax], cg.ebx);
+void CPURecompiler::RemoveBlock(BlockHandle b)
+{
+	DetachBlock(b);
+	FreeBlock(blocks.code[b]);
+	FreeBlock(blocks.cold[b]);
+	blocks.Free(b);
 }
 
-void CPURecompiler::EmitOr(Xbyak::CodeGenerator &cg)
+void CPURecompiler::RetireBlock(BlockHandle b)
 {
-	printf("or %s, %s, %s\n", GetRegName(cur_instr.r_type.rd), GetRegName(cur_instr.r_type.rt), GetRegName(cur_instr.r_type.rs));
+	// Revival reads the code back from RAM
+	if (blocks.hi[b] > sizeof(Bus::ram))
+		return RemoveBlock(b);
 
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.r_type.rs * 4)]);
-	cg.mov(cg.ebx, cg.dword[cg.rax]);
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.r_type.rt * 4)]);
-	cg.mov(cg.ecx, cg.dword[cg.rax]);
-	
-	cg.or_(cg.ebx, cg.ecx);
-	
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.r_type.rd * 4)]);
-	cg.mov(cg.dword[cg.rax], cg.ebx);
+	DetachBlock(b);
+
+	// Only one dormant block per entry point, the newest
+	for (size_t i = 0; i < dormant.size(); i++)
+	{
+		BlockHandle d = dormant[i];
+		if (blocks.guest_addr[d] == blocks.guest_addr[b] && (blocks.flags[d] & block_isolated) == (blocks.flags[b] & block_isolated))
+		{
+			dormant.erase(dormant.begin() + i);
+			FreeBlock(blocks.code[d]);
+			FreeBlock(blocks.cold[d]);
+			blocks.Free(d);
+			break;
+		}
+	}
+
+	if (dormant.size() >= max_dormant)
+	{
+		BlockHandle d = dormant.front();
+		dormant.erase(dormant.begin());
+		FreeBlock(blocks.code[d]);
+		FreeBlock(blocks.cold[d]);
+		blocks.Free(d);
+	}
+
+	dormant.push_back(b);
 }
 
-void CPURecompiler::EmitSLTU(Xbyak::CodeGenerator &cg)
+// Brings back a dormant block for phys if the guest code under it hashes the same as when it was compiled
+HostFunc CPURecompiler::ReviveBlock(uint32_t phys, bool isolated)
 {
-	printf("sltu %s, %s, %s\n", GetRegName(cur_instr.r_type.rd), GetRegName(cur_instr.r_type.rt), GetRegName(cur_instr.r_type.rs));
+	for (size_t i = 0; i < dormant.size(); i++)
+	{
+		BlockHandle b = dormant[i];
+		if (blocks.guest_addr[b] != phys || (bool)(blocks.flags[b] & block_isolated) != isolated)
+			continue;
 
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.r_type.rs * 4)]);
-	cg.mov(cg.ebx, cg.dword[cg.rax]);
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.r_type.rt * 4)]);
-	cg.mov(cg.ecx, cg.dword[cg.rax]);
-	cg.cmp(cg.ebx, cg.ecx);
+		if (HashRanges(blocks.ranges[b]) != blocks.hash[b])
+			return nullptr;
 
-	Xbyak::Label not_less_than;
-	Xbyak::Label end;
+		dormant.erase(dormant.begin() + i);
 
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.r_type.rd * 4)]);
-	cg.jae(not_less_than);
-	cg.mov(cg.dword[cg.rax], 1);
-	cg.jmp(end);
+		cache_mutex.lock();
+		CheckCacheFull();
+		blockMap[BlockKey(phys, isolated)] = b;
+		blockCache.push_back(b);
+		CountCodePages(b, 1);
+		cache_mutex.unlock();
 
-	cg.L(not_less_than);
-	cg.mov(cg.dword[cg.rax], 0);
-	cg.L(end);
+		return blocks.Entry(b);
+	}
+
+	return nullptr;
 }
 
-void CPURecompiler::EmitMFC0(Xbyak::CodeGenerator &cg)
+CPURecompiler::BlockHandle CPURecompiler::BlockTable::Alloc()
 {
-	printf("mfc0 r%d, %s\n", cur_instr.r_type.rd, GetRegName(cur_instr.r_type.rt));
+	if (!free_handles.empty())
+	{
+		BlockHandle h = free_handles.back();
+		free_handles.pop_back();
+		return h;
+	}
 
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, cop0) + (cur_instr.r_type.rd * 4)]);
-	cg.mov(cg.ebx, cg.dword[cg.rax]);
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.r_type.rt * 4)]);
-	cg.mov(cg.dword[cg.rax], cg.ebx);
+	code.push_back(nullptr);
+	cold.push_back(nullptr);
+	guest_addr.push_back(0);
+	hits.push_back(0);
+	flags.push_back(0);
+	lo.push_back(0);
+	hi.push_back(0);
+	hash.push_back(0);
+	ranges.emplace_back();
+	return code.size() - 1;
 }
 
-void CPURecompiler::EmitMTC0(Xbyak::CodeGenerator &cg)
+void CPURecompiler::BlockTable::Free(BlockHandle h)
 {
-	printf("mtc0 r%d, %s\n", cur_instr.r_type.rd, GetRegName(cur_instr.r_type.rt));
+	// Keeps the range storage for the next block to get this handle
+	ranges[h].clear();
+	code[h] = nullptr;
+	cold[h] = nullptr;
+	lo[h] = hi[h] = 0;
+	free_handles.push_back(h);
+}
 
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, regs) + (cur_instr.r_type.rt * 4)]);
-	cg.mov(cg.ebx, cg.dword[cg.rax]);
-	cg.lea(cg.rax, cg.ptr[cg.rbp + offsetof(CPUState, cop0) + (cur_instr.r_type.rd * 4)]);
-	cg.mov(cg.dword[cg.rax], cg.ebx);
+void CPURecompiler::CountCodePages(BlockHandle b, int delta)
+{
+	for (auto& r : blocks.ranges[b])
+	{
+		for (uint32_t page = r.start >> 12; page <= (r.start + r.size - 1) >> 12; page++)
+			code_pages[page] += delta;
+	}
 }
 
-HostFunc CPURecompiler::CompileBlock()
+uint32_t CPURecompiler::GetPC()
 {
-	printf("-----------------------------------\n");
+	return g_state.pc;
+}
 
-	CheckCacheFull();
+void CPURecompiler::ResetConsts()
+{
+	for (int i = 0; i < 32; i++)
+		const_known[i] = false;
 
-	// for (auto b : blockCache)
-	// {
-	// 	if (b->guest_addr == g_state.pc)
-	// 	{
-	// 		b->hits++;
-	// 		return b->entry;
-	// 	}
-	// }
+	const_known[0] = true;
+	const_value[0] = 0;
+}
 
-	void* buffer = AllocBlock(cur_size);
+// Called after each instruction is emitted, with cur_instr still set to it
+void CPURecompiler::UpdateConsts(int& delayed_reg)
+{
+	// A load issued by the previous instruction lands once this one is done, over anything it wrote
+	int landed = delayed_reg;
+	delayed_reg = 0;
 
-	CodeBlock* block = new CodeBlock;
-	block->entry = (HostFunc)buffer;
-	block->Start = (uint8_t*)buffer;
-	block->guest_addr = g_state.pc;
-	block->size = instructions * 4;
-	instructions = 0;
+	auto set = [this](int reg, bool known, uint32_t value)
+	{
+		if (reg == 0)
+			return;
+		const_known[reg] = known;
+		const_value[reg] = value;
+	};
 
-	blockCache.push_back(block);
-	
-	Xbyak::CodeGenerator cg(cur_size, buffer);
+	uint32_t rs = const_value[cur_instr.i_type.rs];
+	bool rs_known = const_known[cur_instr.i_type.rs];
+	uint32_t imm = cur_instr.i_type.imm;
 
-	EmitPrequel(cg);
+	switch (cur_instr.opcode)
+	{
+	case Instructions::special:
+		switch (cur_instr.r_type.func)
+		{
+		case SpecialInstructions::jr:
+			break;
+		case SpecialInstructions::sll:
+			set(cur_instr.r_type.rd, const_known[cur_instr.r_type.rt], const_value[cur_instr.r_type.rt] << cur_instr.r_type.sa);
+			break;
+		case SpecialInstructions::srl:
+			set(cur_instr.r_type.rd, const_known[cur_instr.r_type.rt], const_value[cur_instr.r_type.rt] >> cur_instr.r_type.sa);
+			break;
+		case SpecialInstructions::sra:
+			set(cur_instr.r_type.rd, const_known[cur_instr.r_type.rt], (int32_t)const_value[cur_instr.r_type.rt] >> cur_instr.r_type.sa);
+			break;
+		default:
+			set(cur_instr.r_type.rd, false, 0);
+			break;
+		}
+		break;
+	case Instructions::jal:
+		set(31, false, 0);
+		break;
+	case Instructions::addi:
+	case Instructions::addiu:
+		set(cur_instr.i_type.rt, rs_known, rs + (int32_t)(int16_t)imm);
+		break;
+	case Instructions::andi:
+		set(cur_instr.i_type.rt, rs_known, rs & imm);
+		break;
+	case Instructions::ori:
+		set(cur_instr.i_type.rt, rs_known, rs | imm);
+		break;
+	case Instructions::lui:
+		set(cur_instr.i_type.rt, true, imm << 16);
+		break;
+	case Instructions::cop0:
+		if (cur_instr.r_type.rs == Cop0Instructions::mfc0)
+			set(cur_instr.r_type.rt, false, 0);
+		break;
+	case Instructions::lb:
+	case Instructions::lh:
+	case Instructions::lw:
+	case Instructions::lbu:
+	case Instructions::lhu:
+	case Instructions::lwl:
+	case Instructions::lwr:
+		set(cur_instr.i_type.rt, false, 0);
+		delayed_reg = cur_instr.i_type.rt;
+		break;
+	default:
+		break;
+	}
 
-	for (auto i : cur_instrs)
+	if (landed)
+		const_known[landed] = false;
+}
+
+bool CPURecompiler::GetConstAddr(uint32_t& addr)
+{
+	if (!const_known[cur_instr.i_type.rs])
+		return false;
+
+	addr = const_value[cur_instr.i_type.rs] + (int32_t)(int16_t)cur_instr.i_type.imm;
+	return true;
+}
+
+void CPURecompiler::InvalidateCacheLine(uint32_t address)
+{
+	// The I-cache is 4KiB, direct mapped, with 16 byte lines. Any RAM block
+	// with code in the same line has to go when the line is flushed
+	uint32_t line = address & 0xff0;
+
+	// Whether [start, end) touches the line, with addresses wrapping every 4KiB like the cache
+	auto covers = [line](uint32_t start, uint32_t end)
 	{
-		cur_instr.full = i;
+		uint32_t first = start & ~0xf;
+		uint32_t last = (end - 1) & ~0xf;
+		return last - first >= 0xff0 || ((line - first) & 0xff0) <= last - first;
+	};
 
-		EmitIncPC(cg);
+	for (size_t i = 0; i < blockCache.size();)
+	{
+		BlockHandle b = blockCache[i];
+		bool hit = false;
 
-		if (cur_instr.full == 0)
+		// The bounds take in every range, so most blocks are ruled out without walking them
+		if (covers(blocks.lo[b], blocks.hi[b]))
 		{
-			printf("nop\n");
-			cg.nop();
+			for (auto& r : blocks.ranges[b])
+				hit |= covers(r.start, r.start + r.size);
 		}
+
+		if (hit)
+			RetireBlock(b);
 		else
-		{
-			switch (cur_instr.opcode)
-			{
-			case Instructions::special:
-			{
-				switch (cur_instr.r_type.func)
-				{
-				case SpecialInstructions::jr:
-					EmitJR(cg);
-					break;
-				case SpecialInstructions::addu:
-					EmitADDU(cg);
-					break;
-				case SpecialInstructions::and_:
-					EmitAnd(cg);
-					break;
-				case SpecialInstructions::or_:
-					EmitOr(cg);
-					break;
-				case SpecialInstructions::sltiu:
-					EmitSLTU(cg);
-					break;
-				default:
-					printf("Unknown special instruction 0x%02x (0x%08x)\n", cur_instr.r_type.func, cur_instr.full);
-					exit(1);
-				}
-				break;
-			}
-			case Instructions::jal:
-				EmitJAL(cg);
-				break;
-			case Instructions::j:
-				EmitJ(cg);
-				break;
-			case Instructions::beq:
-				EmitBEQ(cg);
-				break;
-			case Instructions::bne:
-				EmitBNE(cg);
-				break;
-			case Instructions::addi:
-			case Instructions::addiu:
-				EmitAddiu(cg);
-				break;
-			case Instructions::andi:
-				EmitANDI(cg);
-				break;
-			case Instructions::ori:
-				EmitORI(cg);
-				break;
-			case Instructions::lui:
-				EmitLUI(cg);
-				break;
-			case Instructions::cop0:
-			{
-				switch (cur_instr.r_type.rs)
-				{
-				case Cop0Instructions::mfc0:
-					EmitMFC0(cg);
-					break;
-				case Cop0Instructions::mtc0:
-					EmitMTC0(cg);
-					break;
-				default:
-					printf("Unknown cop0 instruction 0x%02x (0x%08x)\n", cur_instr.r_type.rs, cur_instr.full);
-					exit(1);
-				}
-				break;
-			}
-			case Instructions::lb:
-				EmitLB(cg);
-				break;
-			case Instructions::lw:
-				EmitLW(cg);
-				break;
-			case Instructions::sb:
-				EmitSB(cg);
-				break;
-			case Instructions::sh:
-				EmitSH(cg);
-				break;
-			case Instructions::sw:
-				EmitSW(cg);
-				break;
-			default:
-				printf("Unknown instruction 0x%02x (0x%08x)\n", cur_instr.opcode, cur_instr.full);
-				exit(1);
-			}
-		}
+			i++;
+	}
+}
 
-		EmitHandleLoadDelay(cg);
+bool CPURecompiler::IsCacheIsolated()
+{
+	return (g_state.cop0[12] >> 16) & 1;
+}
+
+// Blocks that were hit more than once, and every branch that has been profiled
+void CPURecompiler::SaveProfile(std::vector<ProfiledBlock>& hot, std::vector<ProfiledBranch>& branches)
+{
+	cache_mutex.lock();
+	for (auto& [key, b] : blockMap)
+	{
+		bool superblock = blocks.flags[b] & block_superblock;
+		if (blocks.hits[b] > 1 || superblock)
+			hot.push_back({blocks.guest_addr[b], blocks.hits[b], (uint8_t)((blocks.flags[b] & block_isolated) != 0), superblock, {0, 0}});
 	}
 
-	EmitSequel(cg);
+	for (auto& [phys, p] : branchProfiles)
+	{
+		if (p.taken || p.not_taken)
+			branches.push_back({phys, p.taken, p.not_taken});
+	}
+	cache_mutex.unlock();
+}
 
-	// static int num_bins = 0;
-	// printf("%d\n", num_bins);
-	// std::string fname = "blocks/out" + std::to_string(num_bins++) + ".bin";
+// Only called before emulation starts
+void CPURecompiler::LoadProfile(const std::vector<ProfiledBlock>& hot, const std::vector<ProfiledBranch>& branches)
+{
+	for (auto& b : branches)
+		branchProfiles[b.phys] = {b.taken, b.not_taken};
 
-	// std::ofstream file(fname);
+	for (auto& b : hot)
+	{
+		if (b.superblock)
+			trace_entries.insert(BlockKey(b.phys, b.isolated));
+	}
+}
 
-	// for (int i = 0; i < cur_size; i++)
-	// {
-	// 	file << cg.getCode()[i];
-	// }
+uint64_t CPURecompiler::BlockKey(uint32_t phys, bool isolated)
+{
+	return ((uint64_t)isolated << 32) | phys;
+}
 
-	cur_size = 25;
-	cur_instrs.clear();
+void CPURecompiler::BeginBlock(uint32_t pc)
+{
+	next_addr = Bus::mask_region(pc);
+}
+
+// Called after a branch's delay slot has been added. Superblocks carry on through
+// jumps and through the likely side of conditional branches, with an exit for the
+// other side. pc is updated to where the block continues
+bool CPURecompiler::FollowBranch(uint32_t branch_pc, uint32_t opcode, uint32_t& pc)
+{
+	if (!tracing)
+		return false;
+
+	// The rest of the trace would be compiled for the cache isolation the delay slot may have changed
+	if (EndsBlock(cur_instrs.back()))
+		return false;
 
-	return block->entry;
+	Opcode o;
+	o.full = opcode;
+
+	uint32_t target;
+	bool check = true;
+
+	switch (o.opcode)
+	{
+	case Instructions::j:
+		target = ((branch_pc + 4) & 0xf0000000) | (o.j_type.target << 2);
+		check = false;
+		break;
+	case Instructions::beq:
+	case Instructions::bne:
+	{
+		cache_mutex.lock();
+		auto it = branchProfiles.find(Bus::mask_region(branch_pc));
+		BranchProfile p = it != branchProfiles.end() ? it->second : BranchProfile();
+		cache_mutex.unlock();
+
+		// Only follow branches that clearly favour one side
+		if (p.taken > p.not_taken * 4)
+			target = branch_pc + 4 + ((int32_t)(int16_t)o.i_type.imm << 2);
+		else if (p.not_taken > p.taken * 4)
+			target = pc;
+		else
+			return false;
+		break;
+	}
+	default:
+		return false;
+	}
+
+	uint32_t entry = cur_addrs.front();
+	uint32_t phys = Bus::mask_region(target);
+
+	if (trace_exits.size() >= 4 || cur_instrs.size() >= 128)
+		return false;
+
+	// Loops back to the start are left to the dispatcher, and ROM superblocks are never
+	// invalidated so can't take in RAM code
+	if (phys == entry || Bus::IsROM(phys) != Bus::IsROM(entry))
+		return false;
+	if (phys == 0xA0 || phys == 0xB0 || phys == 0xC0)
+		return false;
+	if (std::find(cur_addrs.begin(), cur_addrs.end(), phys) != cur_addrs.end())
+		return false;
+
+	if (check)
+		trace_exits.push_back({cur_instrs.size() - 1, phys});
+
+	next_addr = phys;
+	pc = target;
+	return true;
 }
 
-void CPURecompiler::MarkBlockDirty(uint32_t address)
+// A short run of straight-line code ending in jr $ra, which leaves $ra alone
+bool CPURecompiler::IsLeaf(uint32_t target)
 {
-	for (int i = 0; i < blockCache.size(); i++)
+	constexpr int max_leaf_instrs = 8;
+
+	uint32_t phys = Bus::mask_region(target);
+	uint32_t len = (max_leaf_instrs + 1) * 4;
+
+	if (phys == 0xA0 || phys == 0xB0 || phys == 0xC0)
+		return false;
+	if (!Bus::GetRAM(target, len) && !(Bus::IsROM(phys) && Bus::IsROM(phys + len - 1)))
+		return false;
+
+	for (int i = 0; i < max_leaf_instrs; i++)
 	{
-		auto& b = blockCache[i];
-		if (b->guest_addr <= address && (b->guest_addr + b->size) > address)
+		uint32_t instr = ReadCode(target + i * 4);
+		Opcode o;
+		o.full = instr;
+
+		if (!IsSupported(instr) || EndsBlock(instr) || DestReg(instr) == 31)
+			return false;
+
+		if (ModifiesPC(instr))
 		{
-			FreeBlock(blockCache[i]->Start);
-			delete blockCache[i];
-			blockCache.erase(blockCache.begin() + i);
-			break;
+			if (o.opcode != Instructions::special || o.r_type.func != SpecialInstructions::jr || o.r_type.rs != 31)
+				return false;
+
+			uint32_t delay = ReadCode(target + i * 4 + 4);
+			return IsSupported(delay) && !ModifiesPC(delay) && !EndsBlock(delay) && DestReg(delay) != 31;
 		}
 	}
+
+	return false;
 }
 
-uint32_t CPURecompiler::GetPC()
+// Called like FollowBranch. A jal to a leaf function carries on into the callee, and
+// the callee's jr $ra carries on at the return address. Both still update the guest
+// registers and PC as usual, so nothing else needs to know the call was inlined
+bool CPURecompiler::InlineCall(uint32_t branch_pc, uint32_t opcode, uint32_t& pc)
 {
-	return g_state.pc;
+	Opcode o;
+	o.full = opcode;
+	size_t index = cur_instrs.size() - 2;
+
+	if (inline_return)
+	{
+		// IsLeaf made sure this is the callee's jr $ra, and $ra still holds inline_return
+		inlined.push_back(index);
+		pc = inline_return;
+		next_addr = Bus::mask_region(pc);
+		inline_return = 0;
+		return true;
+	}
+
+	if (o.opcode != Instructions::jal || cur_instrs.size() >= 128 - 10)
+		return false;
+
+	uint32_t target = ((branch_pc + 4) & 0xf0000000) | (o.j_type.target << 2);
+
+	if (Bus::IsROM(Bus::mask_region(target)) != Bus::IsROM(cur_addrs.front()) || !IsLeaf(target))
+		return false;
+
+	// The callee would be compiled for the cache isolation the delay slot may have changed
+	if (EndsBlock(cur_instrs.back()))
+		return false;
+
+	// A load into $ra landing after the jal would change where the callee returns to
+	if (DestReg(cur_instrs.back()) == 31)
+		return false;
+	if (index > 0 && DestReg(cur_instrs[index - 1]) == 31)
+		return false;
+
+	inlined.push_back(index);
+	inline_return = branch_pc + 8;
+	next_addr = Bus::mask_region(target);
+	pc = target;
+	return true;
+}
+
+bool CPURecompiler::EndsBlock(uint32_t i)
+{
+	Opcode o;
+	o.full = i;
+
+	// Writing SR can change cache isolation, which blocks are specialized on
+	return o.opcode == Instructions::cop0 && o.r_type.rs == Cop0Instructions::mtc0 && o.r_type.rd == 12;
+}
+
+// Whether the recompiler can handle an instruction, so code can be compiled ahead of time
+// without hitting one it can't
+bool CPURecompiler::IsSupported(uint32_t i)
+{
+	Opcode o;
+	o.full = i;
+
+	switch (o.opcode)
+	{
+	case Instructions::special:
+		switch (o.r_type.func)
+		{
+		case SpecialInstructions::sll:
+		case SpecialInstructions::srl:
+		case SpecialInstructions::sra:
+		case SpecialInstructions::sllv:
+		case SpecialInstructions::srlv:
+		case SpecialInstructions::srav:
+		case SpecialInstructions::jr:
+		case SpecialInstructions::jalr:
+		case SpecialInstructions::mfhi:
+		case SpecialInstructions::mthi:
+		case SpecialInstructions::mflo:
+		case SpecialInstructions::mtlo:
+		case SpecialInstructions::mult:
+		case SpecialInstructions::multu:
+		case SpecialInstructions::div_:
+		case SpecialInstructions::divu:
+		case SpecialInstructions::addu:
+		case SpecialInstructions::and_:
+		case SpecialInstructions::or_:
+		case SpecialInstructions::sltiu:
+			return true;
+		default:
+			return i == 0;
+		}
+	case Instructions::cop0:
+		return o.r_type.rs == Cop0Instructions::mfc0 || o.r_type.rs == Cop0Instructions::mtc0;
+	case Instructions::j:
+	case Instructions::jal:
+	case Instructions::beq:
+	case Instructions::bne:
+	case Instructions::addi:
+	case Instructions::addiu:
+	case Instructions::andi:
+	case Instructions::ori:
+	case Instructions::lui:
+	case Instructions::lb:
+	case Instructions::lh:
+	case Instructions::lw:
+	case Instructions::lbu:
+	case Instructions::lhu:
+	case Instructions::sb:
+	case Instructions::sh:
+	case Instructions::sw:
+	case Instructions::lwl:
+	case Instructions::lwr:
+	case Instructions::swl:
+	case Instructions::swr:
+		return true;
+	default:
+		return false;
+	}
 }
 
 bool CPURecompiler::ModifiesPC(uint32_t i)
@@ -739,6 +3085,7 @@ bool CPURecompiler::ModifiesPC(uint32_t i)
 		switch (o.r_type.func)
 		{
 		case SpecialInstructions::jr:
+		case SpecialInstructions::jalr:
 			return true;
 		default:
 			return false;
@@ -756,16 +3103,16 @@ bool CPURecompiler::ModifiesPC(uint32_t i)
 
 void CPURecompiler::CheckCacheFull()
 {
-	if (blockCache.size() >= 32) // 32 blocks max
+	if (blockCache.size() >= max_ram_blocks)
 	{
 		int leastUsed = -1;
-		int leastUsedAmount = INT32_MAX;
-		for (int i = 0; i < blockCache.size(); i++)
+		uint32_t leastUsedAmount = UINT32_MAX;
+		for (size_t i = 0; i < blockCache.size(); i++)
 		{
-			auto b = blockCache[i];
-			if (b->hits < leastUsedAmount)
+			uint32_t hits = blocks.hits[blockCache[i]];
+			if (hits < leastUsedAmount)
 			{
-				leastUsedAmount = b->hits;
+				leastUsedAmount = hits;
 				leastUsed = i;
 			}
 		}
@@ -773,9 +3120,7 @@ void CPURecompiler::CheckCacheFull()
 		if (leastUsed == -1)
 			return;
 
-		FreeBlock(blockCache[leastUsed]->Start);
-		delete blockCache[leastUsed];
-		blockCache.erase(blockCache.begin() + leastUsed);
+		RemoveBlock(blockCache[leastUsed]);
 	}
 }
 
@@ -784,6 +3129,9 @@ bool CPURecompiler::EmitInstruction(uint32_t opcode)
 	cur_instr.full = opcode;
 	instructions++;
 
+	cur_addrs.push_back(next_addr);
+	next_addr += 4;
+
 	cur_size += 30; // For the increment PC
 	cur_size += 15; // For the load delay handler
 
@@ -799,9 +3147,38 @@ bool CPURecompiler::EmitInstruction(uint32_t opcode)
 		{
 			switch (cur_instr.r_type.func)
 			{
+			case SpecialInstructions::sll:
+			case SpecialInstructions::srl:
+			case SpecialInstructions::sra:
+				cur_size += 20;
+				break;
+			case SpecialInstructions::sllv:
+			case SpecialInstructions::srlv:
+			case SpecialInstructions::srav:
+				cur_size += 25;
+				break;
 			case SpecialInstructions::jr:
 				cur_size += 15;
 				break;
+			case SpecialInstructions::jalr:
+				cur_size += 120;
+				break;
+			case SpecialInstructions::mfhi:
+			case SpecialInstructions::mflo:
+				cur_size += 70;
+				break;
+			case SpecialInstructions::mthi:
+			case SpecialInstructions::mtlo:
+				cur_size += 20;
+				break;
+			case SpecialInstructions::mult:
+			case SpecialInstructions::multu:
+				cur_size += 110;
+				break;
+			case SpecialInstructions::div_:
+			case SpecialInstructions::divu:
+				cur_size += 120;
+				break;
 			case SpecialInstructions::addu:
 			case SpecialInstructions::and_:
 			case SpecialInstructions::or_:
@@ -817,7 +3194,7 @@ bool CPURecompiler::EmitInstruction(uint32_t opcode)
 			break;
 		}
 		case Instructions::jal:
-			cur_size += 36;
+			cur_size += 36 + 90;
 			break;
 		case Instructions::j:
 			cur_size += 24;
@@ -856,12 +3233,21 @@ bool CPURecompiler::EmitInstruction(uint32_t opcode)
 		case Instructions::sb:
 		case Instructions::sh:
 		case Instructions::sw:
-			cur_size += 47;
+			cur_size += 37;
 			break;
 		case Instructions::lb:
+		case Instructions::lh:
 		case Instructions::lw:
+		case Instructions::lbu:
+		case Instructions::lhu:
 			cur_size += 55;
 			break;
+		case Instructions::lwl:
+		case Instructions::lwr:
+		case Instructions::swl:
+		case Instructions::swr:
+			cur_size += 100; // Enough for either half of a fused pair too
+			break;
 		default:
 			printf("Unknown instruction 0x%02x (0x%08x)\n", cur_instr.opcode, cur_instr.full);
 			exit(1);
@@ -870,5 +3256,5 @@ bool CPURecompiler::EmitInstruction(uint32_t opcode)
 
 	cur_instrs.push_back(opcode);
 
-	return !ModifiesPC(opcode);
+	return !ModifiesPC(opcode) && !EndsBlock(opcode);
 }
\ No newline at end of file
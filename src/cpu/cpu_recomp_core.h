@@ -4,25 +4,81 @@
 #include <cpu/cpu_ops.h>
 
 #include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
 
 using HostFunc = void (*)();
 
+struct MemBlock;
+
+// A CodeGenerator that can be pointed at a new buffer, so each thread keeps one for
+// hot code and one for cold instead of constructing a pair for every block
+class BlockAssembler : public Xbyak::CodeGenerator
+{
+private:
+	inline static uint8_t no_buffer;
+public:
+	BlockAssembler() : Xbyak::CodeGenerator(0, &no_buffer) {}
+
+	void Retarget(void* buffer, size_t size)
+	{
+		reset();
+		top_ = static_cast<uint8_t*>(buffer);
+		maxSize_ = size;
+	}
+};
+
 class CPURecompiler
 {
 private:
-	uint8_t* base;
+	uint8_t* base; // The hot arena, with the cold one straight after it
+	uint8_t* cold_base;
 	uint8_t* entry; // Keep track of the current block's entry
-	uint32_t cur_size;
+	const uint8_t* sequel; // Shared way back to the dispatcher, in the cold arena
+
+	// Anything describing the block being compiled is per thread, so blocks can be
+	// compiled in the background. Everything else is guarded by cache_mutex
+	inline static thread_local uint32_t cur_size = 25;
+	inline static thread_local std::vector<uint32_t> cur_instrs;
+	inline static thread_local size_t cur_index; // Index of cur_instr in cur_instrs while emitting
 
-	std::vector<uint32_t> cur_instrs;
+	std::mutex cache_mutex;
+	std::recursive_mutex arena_mutex; // The allocator, which the CPU thread also frees from
 
-	void* AllocBlock(uint32_t size);
+	// Where the last allocation in each arena was found, hot then cold. Searches carry
+	// on from there instead of walking every block in front of the free space again
+	MemBlock* rovers[2] = {};
+
+	void InitArena(uint8_t* arena, uint32_t size);
+	void* AllocBlock(uint8_t* arena, uint32_t size);
+	void ShrinkBlock(void* ptr, uint32_t size);
 	void FreeBlock(void* ptr);
 
+	// Slow paths are emitted into a separate buffer in the cold arena, so the code that
+	// normally runs stays packed together. Jumps between the two are rel32
+	inline static thread_local Xbyak::CodeGenerator* cold; // The current block's cold code
+	inline static thread_local BlockAssembler hot_asm, cold_asm;
+	inline static thread_local std::vector<const uint8_t*> side_exits; // Cold code for each of trace_exits
+
+	uint8_t* EmitJumpBack();
+	void BindJumpBack(Xbyak::CodeGenerator& cg, uint8_t* jump);
+
 	void EmitPrequel(Xbyak::CodeGenerator& cg);
 	void EmitSequel(Xbyak::CodeGenerator& cg);
+	void EmitRestore(Xbyak::CodeGenerator& cg);
+	void EmitLookupLink(Xbyak::CodeGenerator& cg, Xbyak::Label& miss);
+	void EmitPushReturn(Xbyak::CodeGenerator& cg);
+	void EmitExit(Xbyak::CodeGenerator& cg, bool chain, bool predict_return);
+	void EmitCall(Xbyak::CodeGenerator& cg, const void* func);
 	void EmitIncPC(Xbyak::CodeGenerator& cg);
+	uint8_t inc_pc_code[32]; // What EmitIncPC emits, which is the same every time, assembled once
+	size_t inc_pc_size;
 	void EmitHandleLoadDelay(Xbyak::CodeGenerator& cg);
+	void EmitFoldedLoad(Xbyak::CodeGenerator& cg, uint32_t value);
+	void EmitLoadReg(Xbyak::CodeGenerator& cg, const Xbyak::Reg32& dst, int reg);
+	void EmitStoreReg(Xbyak::CodeGenerator& cg, int reg, const Xbyak::Reg32& src);
+	void EmitStoreReg(Xbyak::CodeGenerator& cg, int reg, uint32_t value);
 
 	void EmitJ(Xbyak::CodeGenerator& cg); // 0x02
 	void EmitJAL(Xbyak::CodeGenerator& cg); // 0x03
@@ -33,17 +89,42 @@ private:
 	void EmitORI(Xbyak::CodeGenerator& cg); // 0x0D
 	void EmitLUI(Xbyak::CodeGenerator& cg); // 0x0F
 	void EmitLB(Xbyak::CodeGenerator& cg); // 0x20
+	void EmitLH(Xbyak::CodeGenerator& cg); // 0x21
+	void EmitLWL(Xbyak::CodeGenerator& cg); // 0x22
 	void EmitLW(Xbyak::CodeGenerator& cg); // 0x23
+	void EmitLBU(Xbyak::CodeGenerator& cg); // 0x24
+	void EmitLHU(Xbyak::CodeGenerator& cg); // 0x25
+	void EmitLWR(Xbyak::CodeGenerator& cg); // 0x26
 	void EmitSB(Xbyak::CodeGenerator& cg); // 0x28
 	void EmitSH(Xbyak::CodeGenerator& cg); // 0x29
+	void EmitSWL(Xbyak::CodeGenerator& cg); // 0x2A
 	void EmitSW(Xbyak::CodeGenerator& cg); // 0x2B
+	void EmitSWR(Xbyak::CodeGenerator& cg); // 0x2E
+	void EmitUnaligned(Xbyak::CodeGenerator& cg, const void* func);
 
 	// Special opcodes
+	void EmitSLL(Xbyak::CodeGenerator& cg); // 0x00
+	void EmitSRL(Xbyak::CodeGenerator& cg); // 0x02
+	void EmitSRA(Xbyak::CodeGenerator& cg); // 0x03
+	void EmitSLLV(Xbyak::CodeGenerator& cg); // 0x04
+	void EmitSRLV(Xbyak::CodeGenerator& cg); // 0x06
+	void EmitSRAV(Xbyak::CodeGenerator& cg); // 0x07
 	void EmitJR(Xbyak::CodeGenerator& cg); // 0x08
+	void EmitJALR(Xbyak::CodeGenerator& cg); // 0x09
+	void EmitMFHI(Xbyak::CodeGenerator& cg); // 0x10
+	void EmitMTHI(Xbyak::CodeGenerator& cg); // 0x11
+	void EmitMFLO(Xbyak::CodeGenerator& cg); // 0x12
+	void EmitMTLO(Xbyak::CodeGenerator& cg); // 0x13
+	void EmitMULT(Xbyak::CodeGenerator& cg); // 0x18
+	void EmitMULTU(Xbyak::CodeGenerator& cg); // 0x19
+	void EmitDIV(Xbyak::CodeGenerator& cg); // 0x1A
+	void EmitDIVU(Xbyak::CodeGenerator& cg); // 0x1B
 	void EmitADDU(Xbyak::CodeGenerator& cg); // 0x21
 	void EmitAnd(Xbyak::CodeGenerator& cg); // 0x24
 	void EmitOr(Xbyak::CodeGenerator& cg); // 0x25
 	void EmitSLTU(Xbyak::CodeGenerator& cg); // 0x2B
+	void EmitMDUBusy(Xbyak::CodeGenerator& cg, const Xbyak::Reg32& latency);
+	void EmitMDUWait(Xbyak::CodeGenerator& cg);
 
 	// Cop0 opcodes
 	void EmitMFC0(Xbyak::CodeGenerator& cg); // 0x00
@@ -51,28 +132,222 @@ private:
 
 	typedef struct
 	{
-		uint8_t* Start;
-		HostFunc entry;
-		uint32_t guest_addr;
-		size_t hits = 1; // Number of times this block has been used
-		bool dirty = false;
-		size_t size = 0;
-	} CodeBlock;
+		uint32_t start; // Physical
+		uint32_t size;
+	} GuestRange;
+
+	typedef uint32_t BlockHandle;
+
+	enum BlockFlags : uint8_t
+	{
+		block_rom = 1, // Compiled from the BIOS, never invalidated or evicted
+		block_isolated = 2, // Compiled with the cache isolated (SR.IsC set)
+		block_superblock = 4, // Compiled as a trace along the profiled path
+	};
 
-	std::vector<CodeBlock*> blockCache;
+	// Metadata for every compiled block, stored by field and indexed by handle so
+	// scans only touch what they test. Handles of removed blocks are reused, along
+	// with their range storage
+	struct BlockTable
+	{
+		std::vector<uint8_t*> code; // Hot code, starting with the entry point
+		std::vector<uint8_t*> cold; // Slow paths, side exits and data
+		std::vector<uint32_t> guest_addr; // Physical, so KUSEG/KSEG0/KSEG1 mirrors share blocks
+		std::vector<uint32_t> hits; // Number of times the block has been used
+		std::vector<uint8_t> flags;
+		std::vector<uint32_t> lo, hi; // Bounds of all the guest code, for rejecting blocks without walking ranges
+		std::vector<uint64_t> hash; // Of the guest code, in the order it was compiled
+		std::vector<std::vector<GuestRange>> ranges; // All the guest code the block was compiled from
+		std::vector<BlockHandle> free_handles;
 
-	int instructions = 0;
+		BlockHandle Alloc();
+		void Free(BlockHandle h);
+		HostFunc Entry(BlockHandle h) { return (HostFunc)code[h]; }
+	} blocks;
+	inline static thread_local std::vector<GuestRange> cur_ranges;
+
+	typedef struct
+	{
+		uint32_t taken = 0;
+		uint32_t not_taken = 0;
+	} BranchProfile;
+
+	// Filled in by blocks that haven't been made into superblocks yet, keyed by physical address
+	std::unordered_map<uint32_t, BranchProfile> branchProfiles;
+
+	// Blocks that were superblocks in a loaded profile, by BlockKey. They're traced
+	// from their first compile, along the branch profiles loaded with them
+	std::unordered_set<uint64_t> trace_entries;
+
+	// Superblock formation state
+	inline static thread_local bool tracing = false;
+	inline static thread_local uint32_t next_addr; // Physical address of the next instruction passed to EmitInstruction
+	inline static thread_local uint32_t cur_addr; // Physical address of cur_instr while compiling
+	inline static thread_local std::vector<uint32_t> cur_addrs;
+	inline static thread_local std::vector<std::pair<size_t, uint32_t>> trace_exits; // Delay slot index, expected physical PC after it
+
+	bool Overlaps(BlockHandle b, uint32_t address, uint32_t size);
+	void EmitProfileBranch(Xbyak::CodeGenerator& cg, Xbyak::Label& not_taken);
+	void EmitTraceExit(Xbyak::CodeGenerator& cg, uint32_t expected, const uint8_t* exit);
+
+	// Number of blocks with code in each 4KiB page of RAM, so stores to pages without
+	// any can skip looking for blocks to invalidate
+	uint16_t code_pages[0x200] = {};
+	void CountCodePages(BlockHandle b, int delta);
+
+	std::vector<BlockHandle> blockCache; // RAM blocks, which can be evicted
+	std::unordered_map<uint64_t, BlockHandle> blockMap; // All blocks, by BlockKey
+
+	inline static thread_local bool isolated; // Cache isolation state of the block being compiled
+	bool IsCacheIsolated();
+	uint64_t BlockKey(uint32_t phys, bool isolated);
+
+	// Guest registers whose value is known at compile time
+	inline static thread_local bool const_known[32];
+	inline static thread_local uint32_t const_value[32];
+
+	void ResetConsts();
+	void UpdateConsts(int& delayed_reg);
+	bool GetConstAddr(uint32_t& addr);
+
+	inline static thread_local int instructions = 0;
+
+	// Self-loops run again without going back through the dispatcher, keeping the guest
+	// registers they use most in r12-r14. Registers that are loaded into stay in g_state,
+	// since HandleLoadDelay writes there
+	inline static thread_local int loop_regs[32]; // Host register index for each guest register, 0 if it's in g_state
+	uint32_t generation = 0; // Bumped whenever a block is removed, so a loop can tell its code may be gone
+
+	// A run of loads and stores off the same base register, which doesn't change in between
+	typedef struct
+	{
+		size_t start, end; // Indices of the first and last access
+		int base;
+		int32_t min, max; // Lowest and highest byte touched, relative to the base
+	} AccessGroup;
+
+	inline static thread_local std::vector<AccessGroup> access_groups;
+	inline static thread_local int fast_base; // Accesses off this register go straight to RAM, 0 for none
+
+	void FindAccessGroups();
+	void EmitGroupGuard(Xbyak::CodeGenerator& cg, const AccessGroup& group, const uint8_t* slow);
+	bool EmitFastAccess(Xbyak::CodeGenerator& cg);
+
+	// lwl/lwr and swl/swr pairs that make up one unaligned word access. The first of
+	// the pair emits nothing, and the second does the whole access
+	inline static thread_local std::vector<size_t> fused_pairs; // Index of the first of each pair
+
+	void FindUnalignedPairs();
+	void EmitFusedUnaligned(Xbyak::CodeGenerator& cg, size_t index);
+
+	bool IsSelfLoop();
+	void AssignLoopRegs();
+	void EmitLoop(Xbyak::CodeGenerator& cg, bool chain);
+	void EmitBody(Xbyak::CodeGenerator& cg, std::vector<const uint8_t*>& exits);
+	void EmitStep(Xbyak::CodeGenerator& cg, size_t index, int& delayed_reg, size_t& next_exit, std::vector<const uint8_t*>& exits);
 
-	bool ModifiesPC(uint32_t i);
 	void CheckCacheFull();
+	void ResetBlockState();
+	BlockHandle PublishBlock(uint8_t* code, uint8_t* cold, uint32_t phys, uint8_t flags, uint64_t hash, const std::vector<GuestRange>& ranges);
+
+	// Blocks compiled on the speculation thread wait here for the CPU thread to
+	// check their code is still current and publish them
+	typedef struct
+	{
+		uint8_t* code;
+		uint8_t* cold;
+		uint32_t phys;
+		uint8_t flags;
+		uint64_t hash;
+		std::vector<GuestRange> ranges;
+	} SpeculatedBlock;
+
+	inline static thread_local bool speculative = false; // Compiling on the speculation thread
+	std::vector<SpeculatedBlock> speculated;
+	uint32_t ReadCode(uint32_t addr);
+	bool Fetch(uint32_t pc, uint32_t& opcode);
+	void QueueSuccessors(uint32_t branch_pc, uint32_t opcode);
+	void DetachBlock(BlockHandle b);
+	void RemoveBlock(BlockHandle b);
+
+	// Invalidated RAM blocks keep their code for a while, oldest first, so code that
+	// gets written back unchanged (overlays, DMA loads) can be reused without recompiling
+	static constexpr size_t max_dormant = 64;
+	std::vector<BlockHandle> dormant;
+	void RetireBlock(BlockHandle b);
+	uint64_t HashRanges(const std::vector<GuestRange>& ranges);
+	HostFunc ReviveBlock(uint32_t phys, bool isolated);
+
+	// jump_cache and return_stack are only filled from LookupBlock, and flushed
+	// whenever the cache isolation state they were filled under changes
+	bool links_isolated = false;
+	void LinkBlock(uint32_t pc, BlockHandle b);
+	void UnlinkBlock(BlockHandle b);
+	void FlushLinks();
+
+	// Small leaf functions are compiled into their callers
+	inline static thread_local uint32_t inline_return = 0; // Where the callee being inlined returns to, 0 outside of one
+	inline static thread_local std::vector<size_t> inlined; // Indices of the jal and jr $ra of each inlined call
+	inline static thread_local bool cur_inlined; // cur_instr belongs to an inlined call
+
+	bool IsLeaf(uint32_t target);
+	bool InlineCall(uint32_t branch_pc, uint32_t opcode, uint32_t& pc);
+
+	void BeginBlock(uint32_t pc);
+	bool FollowBranch(uint32_t branch_pc, uint32_t opcode, uint32_t& pc);
+
+	bool EmitInstruction(uint32_t opcode);
+	HostFunc CompileBlock();
 public:
 	CPURecompiler();
 	~CPURecompiler();
 
-	bool EmitInstruction(uint32_t opcode);
-	HostFunc CompileBlock();
+	inline static bool disassemble = false; // Print every instruction as it's compiled
+	static constexpr size_t max_ram_blocks = 32; // The least used one is evicted to make room past this
+
+	bool ModifiesPC(uint32_t i);
+	bool EndsBlock(uint32_t i);
+	bool IsSupported(uint32_t i);
+
+	// Safe to call from any thread
+	HostFunc Compile(uint32_t pc, int max_instrs);
+	HostFunc CompileSpeculative(uint32_t pc, int max_instrs); // nullptr if the code can't be compiled
+	void AdoptSpeculated(); // CPU thread only
+
+	// What a run learned about the guest code, as kept between runs by Profile
+	struct ProfiledBlock
+	{
+		uint32_t phys;
+		uint32_t hits;
+		uint8_t isolated;
+		uint8_t superblock;
+		uint8_t pad[2];
+	};
+
+	struct ProfiledBranch
+	{
+		uint32_t phys;
+		uint32_t taken;
+		uint32_t not_taken;
+	};
+
+	void SaveProfile(std::vector<ProfiledBlock>& hot, std::vector<ProfiledBranch>& branches);
+	void LoadProfile(const std::vector<ProfiledBlock>& hot, const std::vector<ProfiledBranch>& branches);
+	HostFunc LookupBlock(uint32_t pc);
+
+	// Counters for the benchmarks. Lookups are only made from the CPU thread,
+	// and blocks are only published under cache_mutex
+	struct Stats
+	{
+		uint64_t lookups; // Calls to LookupBlock
+		uint64_t hits; // Lookups that found a block to run
+		uint64_t compiled; // Blocks published, including adopted speculative ones
+		uint64_t compiled_instrs; // Guest instructions in those blocks
+	} stats = {};
 
 	void MarkBlockDirty(uint32_t address);
+	void MarkRangeDirty(uint32_t address, uint32_t size);
+	void InvalidateCacheLine(uint32_t address);
 
 	uint32_t GetPC();
 };
\ No newline at end of file
@@ -0,0 +1,78 @@
+#include <cpu/cpu_speculate.h>
+#include <cpu/cpu_recomp_core.h>
+#include <memory/Bus.h>
+#include <util/log.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#define MODULE "Speculate"
+
+// The newest guesses are the most likely to be needed soon, so they're compiled
+// first, and the oldest are dropped once too many pile up
+static constexpr size_t max_queued = 64;
+
+static std::mutex queue_mutex;
+static std::condition_variable queue_cv;
+static std::deque<uint32_t> queue;
+static bool stopping = false;
+static std::thread worker;
+static size_t compiled = 0;
+
+void Speculate::Queue(uint32_t pc)
+{
+	queue_mutex.lock();
+	if (std::find(queue.begin(), queue.end(), pc) == queue.end())
+	{
+		if (queue.size() >= max_queued)
+			queue.pop_front();
+		queue.push_back(pc);
+	}
+	queue_mutex.unlock();
+
+	queue_cv.notify_one();
+}
+
+void Speculate::Start(int max_instrs)
+{
+	worker = std::thread([max_instrs]()
+	{
+		while (true)
+		{
+			std::unique_lock<std::mutex> lock(queue_mutex);
+			queue_cv.wait(lock, []() { return stopping || !queue.empty(); });
+			if (stopping)
+				return;
+
+			uint32_t pc = queue.back();
+			queue.pop_back();
+			lock.unlock();
+
+			if (Bus::recomp->CompileSpeculative(pc, max_instrs))
+				compiled++;
+		}
+	});
+
+	active = true;
+	std::atexit(Stop);
+	log("Compiling branch targets in the background\n");
+}
+
+void Speculate::Stop()
+{
+	if (!active)
+		return;
+
+	queue_mutex.lock();
+	stopping = true;
+	queue_mutex.unlock();
+	queue_cv.notify_one();
+
+	worker.join();
+	active = false;
+	log("Compiled %zu blocks ahead of time\n", compiled);
+}
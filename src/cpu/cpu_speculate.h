@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstdint>
+
+// Compiles the blocks that newly compiled blocks branch to on a background
+// thread, so the CPU usually finds them ready the first time it gets there
+namespace Speculate
+{
+	inline bool enabled = false;
+	inline bool active = false; // The thread is running
+
+	void Start(int max_instrs);
+	void Stop();
+	void Queue(uint32_t pc);
+};
@@ -1,16 +1,104 @@
 #include <Application.h>
 #include <util/log.h>
+#include <cpu/bios_hle.h>
+#include <cpu/cpu_precompile.h>
+#include <cpu/cpu_speculate.h>
+#include <cpu/cpu_profile.h>
+#include <cpu/cpu_recomp_core.h>
+#include <memory/Bus.h>
+#include <tools/fuzz.h>
+#include <tools/bench.h>
 
 #define MODULE "Main"
 
 int main(int argc, char** argv)
 {
-	if (argc < 2)
+	std::string bios_path;
+	int fuzz_cases = 0;
+	uint32_t seed = 1;
+	std::string bench_path, bench_compile_path, bench_mem_path;
+	RunLimits limits;
+	int rounds = 20;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+
+		if (arg == "--hle")
+			BiosHLE::enabled = true;
+		else if (arg == "--precompile")
+			Precompile::enabled = true;
+		else if (arg == "--speculate")
+			Speculate::enabled = true;
+		else if (arg == "--profile" && i + 1 < argc)
+			Profile::path = argv[++i];
+		else if (arg == "--fuzz" && i + 1 < argc)
+			fuzz_cases = std::stoi(argv[++i]);
+		else if (arg == "--seed" && i + 1 < argc)
+			seed = std::stoul(argv[++i]);
+		else if (arg == "--bench" && i + 1 < argc)
+			bench_path = argv[++i];
+		else if (arg == "--bench-compile" && i + 1 < argc)
+			bench_compile_path = argv[++i];
+		else if (arg == "--bench-mem" && i + 1 < argc)
+			bench_mem_path = argv[++i];
+		else if (arg == "--rounds" && i + 1 < argc)
+			rounds = std::stoi(argv[++i]);
+		else if (arg == "--disasm")
+			CPURecompiler::disassemble = true;
+		else if (arg == "--instrs" && i + 1 < argc)
+			limits.instrs = std::stoull(argv[++i]);
+		else if (arg == "--cycles" && i + 1 < argc)
+			limits.cycles = std::stoull(argv[++i]);
+		else if (arg == "--frames" && i + 1 < argc)
+			limits.frames = std::stoull(argv[++i]);
+		else if (arg == "--seconds" && i + 1 < argc)
+			limits.seconds = std::stod(argv[++i]);
+		else
+			bios_path = arg;
+	}
+
+	// Fuzzing and benchmarking only need the recompiler, not a BIOS
+	if (fuzz_cases)
+	{
+		new CPURecompiler();
+		return Fuzz::Run(seed, fuzz_cases) ? 1 : 0;
+	}
+
+	if (!bench_path.empty())
+	{
+		new CPURecompiler();
+		return Bench::Run(bench_path, limits.instrs ? limits.instrs : 100000000);
+	}
+
+	if (!bench_mem_path.empty())
+	{
+		new CPURecompiler();
+		return Bench::RunMemory(bench_mem_path);
+	}
+
+	if (bios_path.empty())
 	{
-		log("Usage: %s <bios>\n", argv[0]);
+		log("Usage: %s [--hle] [--precompile] [--speculate] [--profile <file>] [--disasm]\n"
+			"           [--instrs <n>] [--cycles <n>] [--frames <n>] [--seconds <s>] <bios>\n"
+			"       %s --fuzz <cases> [--seed <n>]\n"
+			"       %s --bench <out.json> [--instrs <n>]\n"
+			"       %s --bench-compile <out.json> [--rounds <n>] <bios>\n"
+			"       %s --bench-mem <out.json>\n",
+			argv[0], argv[0], argv[0], argv[0], argv[0]);
 		return 0;
 	}
 
-	Application::Init(argv[1]);
-	Application::Run();
+	// The compile benchmark needs a BIOS to find blocks in, but doesn't run it
+	if (!bench_compile_path.empty())
+	{
+		Bus::Bus(bios_path);
+		new CPURecompiler();
+		return Bench::RunCompile(bench_compile_path, rounds);
+	}
+
+	Application::Init(bios_path);
+	Application::Run(limits);
+
+	return 0;
 }
\ No newline at end of file
@@ -27,6 +27,21 @@ namespace Bus
 	}
 	void Bus(std::string biosFile);
 
+	// The BIOS is read-only, so anything compiled or loaded from it never changes
+	inline bool IsROM(uint32_t addr) {
+		return addr >= 0x1fc00000 && addr < 0x1fc80000;
+	}
+
+	// Get a host pointer to len bytes of guest RAM, or nullptr if the range isn't all in RAM
+	inline uint8_t* GetRAM(uint32_t addr, uint32_t len) {
+		addr = mask_region(addr);
+
+		if (addr >= 0x00200000 || len > 0x00200000 - addr)
+			return nullptr;
+
+		return &ram[addr];
+	}
+
 	template<typename T>
 	T read(uint32_t addr)
 	{
@@ -36,7 +51,7 @@ namespace Bus
 			return *(T*)&ram[addr];
 		if (addr >= 0x1f000000 && addr < 0x1f080000)
 			return 0xff;
-		if (addr >= 0x1fc00000 && addr < 0x1fc80000)
+		if (IsROM(addr))
 			return *(T*)&bios[addr - 0x1fc00000];
 
 		panic("Couldn't read from addr 0x%08x\n", addr);
@@ -84,7 +99,10 @@ namespace Bus
 	inline static void Write32(uint32_t addr, uint32_t data) {write<uint32_t>(addr, data);}
 	inline static void Write16(uint32_t addr, uint16_t data) {write<uint16_t>(addr, data);}
 	inline static void Write8(uint32_t addr, uint8_t data) {write<uint8_t>(addr, data);}
+	// Stores with SR.IsC set land in the I-cache instead of memory
+	inline static void WriteIsolated(uint32_t addr) {recomp->InvalidateCacheLine(mask_region(addr));}
 	inline static uint32_t Read32(uint32_t addr) {return read<uint32_t>(addr);}
+	inline static uint16_t Read16(uint32_t addr) {return read<uint16_t>(addr);}
 	inline static uint8_t Read8(uint32_t addr) {return read<uint8_t>(addr);}
 };
 
@@ -0,0 +1,439 @@
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <tools/bench.h>
+#include <cpu/cpu_core.h>
+#include <cpu/cpu_ops.h>
+#include <cpu/cpu_precompile.h>
+#include <memory/Bus.h>
+#include <util/log.h>
+
+#define MODULE "Bench"
+
+// Each workload's code gets 64KiB to itself, so none of them share blocks
+static constexpr uint32_t code_addr = 0x80010000;
+static constexpr uint32_t code_stride = 0x10000;
+static constexpr uint32_t data_addr = 0x80100000;
+static constexpr uint32_t stack_top = 0x801ff000;
+
+// Deadlines are set a frame apart, the same as Application::Run
+static constexpr uint64_t frame_cycles = 33868800 / 60;
+
+enum Regs
+{
+	zero, at, v0, v1, a0, a1, a2, a3,
+	t0, t1, t2, t3, t4, t5, t6, t7,
+	s0, s1, s2, s3, s4, s5, s6, s7,
+	t8, t9, k0, k1, gp, sp, fp, ra,
+};
+
+// Just enough of an assembler for the workloads. Branches and jumps take
+// instruction indices, and return their own so forward ones can be patched
+class Assembler
+{
+private:
+	uint32_t base;
+
+	int R(int func, int rs, int rt, int rd, int sa = 0)
+	{
+		code.push_back((rs << 21) | (rt << 16) | (rd << 11) | (sa << 6) | func);
+		return code.size() - 1;
+	}
+
+	int I(int op, int rs, int rt, uint16_t imm)
+	{
+		code.push_back((op << 26) | (rs << 21) | (rt << 16) | imm);
+		return code.size() - 1;
+	}
+
+	int J(int op, int target)
+	{
+		code.push_back((op << 26) | (((base + target * 4) & 0x0fffffff) >> 2));
+		return code.size() - 1;
+	}
+public:
+	std::vector<uint32_t> code;
+
+	Assembler(uint32_t base) : base(base) {}
+
+	int Here() { return code.size(); }
+
+	// Points the branch or jump at index at target
+	void Patch(int index, int target)
+	{
+		Opcode o;
+		o.full = code[index];
+
+		if (o.opcode == Instructions::j || o.opcode == Instructions::jal)
+			code[index] = (o.full & 0xfc000000) | (((base + target * 4) & 0x0fffffff) >> 2);
+		else
+			code[index] = (o.full & 0xffff0000) | (uint16_t)(target - (index + 1));
+	}
+
+	void Li(int rt, uint32_t value)
+	{
+		Lui(rt, value >> 16);
+		Ori(rt, rt, value & 0xffff);
+	}
+
+	void Nop() { code.push_back(0); }
+	void Sll(int rd, int rt, int sa) { R(SpecialInstructions::sll, 0, rt, rd, sa); }
+	void Srl(int rd, int rt, int sa) { R(SpecialInstructions::srl, 0, rt, rd, sa); }
+	void Sllv(int rd, int rt, int rs) { R(SpecialInstructions::sllv, rs, rt, rd); }
+	void Srav(int rd, int rt, int rs) { R(SpecialInstructions::srav, rs, rt, rd); }
+	void Jr(int rs) { R(SpecialInstructions::jr, rs, 0, 0); }
+	void Addu(int rd, int rs, int rt) { R(SpecialInstructions::addu, rs, rt, rd); }
+	void And(int rd, int rs, int rt) { R(SpecialInstructions::and_, rs, rt, rd); }
+	void Or(int rd, int rs, int rt) { R(SpecialInstructions::or_, rs, rt, rd); }
+	void Sltu(int rd, int rs, int rt) { R(SpecialInstructions::sltiu, rs, rt, rd); }
+
+	int Jmp(int target = 0) { return J(Instructions::j, target); }
+	int Jal(int target = 0) { return J(Instructions::jal, target); }
+	int Beq(int rs, int rt, int target = 0) { return I(Instructions::beq, rs, rt, target - (Here() + 1)); }
+	int Bne(int rs, int rt, int target = 0) { return I(Instructions::bne, rs, rt, target - (Here() + 1)); }
+
+	void Addiu(int rt, int rs, int16_t imm) { I(Instructions::addiu, rs, rt, imm); }
+	void Andi(int rt, int rs, uint16_t imm) { I(Instructions::andi, rs, rt, imm); }
+	void Ori(int rt, int rs, uint16_t imm) { I(Instructions::ori, rs, rt, imm); }
+	void Lui(int rt, uint16_t imm) { I(Instructions::lui, 0, rt, imm); }
+
+	void Lb(int rt, int16_t off, int rs) { I(Instructions::lb, rs, rt, off); }
+	void Lh(int rt, int16_t off, int rs) { I(Instructions::lh, rs, rt, off); }
+	void Lwl(int rt, int16_t off, int rs) { I(Instructions::lwl, rs, rt, off); }
+	void Lw(int rt, int16_t off, int rs) { I(Instructions::lw, rs, rt, off); }
+	void Lbu(int rt, int16_t off, int rs) { I(Instructions::lbu, rs, rt, off); }
+	void Lhu(int rt, int16_t off, int rs) { I(Instructions::lhu, rs, rt, off); }
+	void Lwr(int rt, int16_t off, int rs) { I(Instructions::lwr, rs, rt, off); }
+	void Sb(int rt, int16_t off, int rs) { I(Instructions::sb, rs, rt, off); }
+	void Sh(int rt, int16_t off, int rs) { I(Instructions::sh, rs, rt, off); }
+	void Sw(int rt, int16_t off, int rs) { I(Instructions::sw, rs, rt, off); }
+};
+
+// Straight line arithmetic in a self-loop that never exits
+static void Alu(Assembler& a)
+{
+	a.Li(s0, 0x12345678);
+	a.Li(s1, 0x9e3779b9);
+
+	int loop = a.Here();
+	a.Addu(t0, s0, s1);
+	a.Sll(t1, t0, 7);
+	a.Srl(t2, t0, 25);
+	a.Or(t3, t1, t2);
+	a.Addu(s0, t3, s1);
+	a.Andi(t4, s0, 0x1f);
+	a.Sllv(t5, s1, t4);
+	a.Srav(t6, s0, t4);
+	a.And(t7, t5, t6);
+	a.Sltu(t8, t7, s0);
+	a.Addu(s1, s1, t8);
+	a.Addiu(s1, s1, 0x3b);
+	a.Ori(t9, s1, 1);
+	a.Bne(t9, zero, loop);
+	a.Addu(v0, v0, t3);
+}
+
+// Branches on bits of a pseudo random number, so they go both ways unpredictably
+static void Branchy(Assembler& a)
+{
+	a.Li(s0, 1);
+	a.Li(s2, 0x3c6ef35f);
+
+	int loop = a.Here();
+	a.Sll(t0, s0, 5);
+	a.Addu(s0, s0, t0);
+	a.Addu(s0, s0, s2);
+	a.Srl(t1, s0, 16);
+
+	a.Andi(t2, t1, 1);
+	int skip_inc = a.Beq(t2, zero);
+	a.Nop();
+	a.Addiu(v0, v0, 1);
+	a.Patch(skip_inc, a.Here());
+
+	a.Andi(t2, t1, 6);
+	int skip_dec = a.Bne(t2, zero);
+	a.Addiu(v1, v1, 1);
+	a.Addiu(v1, v1, -3);
+	a.Patch(skip_dec, a.Here());
+
+	a.Sltu(t3, v0, v1);
+	int skip_add = a.Beq(t3, zero);
+	a.Nop();
+	a.Addu(a0, a0, t1);
+	a.Patch(skip_add, a.Here());
+
+	a.Or(a1, a1, t1);
+	a.Jmp(loop);
+	a.Nop();
+}
+
+// 16KiB copied a word at a time, four words at a time, then a byte at a time
+static void Memcpy(Assembler& a)
+{
+	a.Li(s0, data_addr);
+	a.Li(s1, data_addr + 0x8000);
+	a.Addiu(s2, s0, 0x4000);
+
+	int loop = a.Here();
+	a.Addu(a0, s0, zero);
+	a.Addu(a1, s1, zero);
+	int words = a.Here();
+	a.Lw(t0, 0, a0);
+	a.Addiu(a0, a0, 4);
+	a.Addiu(a1, a1, 4);
+	a.Bne(a0, s2, words);
+	a.Sw(t0, -4, a1);
+
+	a.Addu(a0, s0, zero);
+	a.Addu(a1, s1, zero);
+	int unrolled = a.Here();
+	a.Lw(t0, 0, a0);
+	a.Lw(t1, 4, a0);
+	a.Lw(t2, 8, a0);
+	a.Lw(t3, 12, a0);
+	a.Sw(t0, 0, a1);
+	a.Sw(t1, 4, a1);
+	a.Sw(t2, 8, a1);
+	a.Sw(t3, 12, a1);
+	a.Addiu(a0, a0, 16);
+	a.Bne(a0, s2, unrolled);
+	a.Addiu(a1, a1, 16);
+
+	a.Addu(a0, s0, zero);
+	a.Addu(a1, s1, zero);
+	int bytes = a.Here();
+	a.Lbu(t0, 0, a0);
+	a.Addiu(a0, a0, 1);
+	a.Addiu(a1, a1, 1);
+	a.Bne(a0, s2, bytes);
+	a.Sb(t0, -1, a1);
+
+	a.Jmp(loop);
+	a.Nop();
+}
+
+// Nested calls that save and restore registers on the stack, ending in a leaf
+static void Calls(Assembler& a)
+{
+	int to_main = a.Jmp();
+	a.Nop();
+
+	int leaf = a.Here();
+	a.Addu(v0, a0, a0);
+	a.Jr(ra);
+	a.Addiu(v0, v0, 1);
+
+	int func = a.Here();
+	a.Addiu(sp, sp, -24);
+	a.Sw(ra, 20, sp);
+	a.Sw(s0, 16, sp);
+	a.Addu(s0, a0, zero);
+	a.Jal(leaf);
+	a.Addiu(a0, a0, 3);
+	a.Addu(v0, v0, s0);
+	a.Lw(ra, 20, sp);
+	a.Lw(s0, 16, sp);
+	a.Jr(ra);
+	a.Addiu(sp, sp, 24);
+
+	int outer = a.Here();
+	a.Addiu(sp, sp, -24);
+	a.Sw(ra, 20, sp);
+	a.Sw(s1, 16, sp);
+	a.Jal(func);
+	a.Addu(s1, a0, zero);
+	a.Addu(a0, v0, s1);
+	a.Jal(func);
+	a.Addu(s1, v0, zero);
+	a.Addu(v0, v0, s1);
+	a.Lw(ra, 20, sp);
+	a.Lw(s1, 16, sp);
+	a.Jr(ra);
+	a.Addiu(sp, sp, 24);
+
+	a.Patch(to_main, a.Here());
+	int loop = a.Here();
+	a.Jal(outer);
+	a.Addiu(a0, a0, 1);
+	a.Addu(s2, s2, v0);
+	a.Jal(func);
+	a.Andi(a0, s2, 0xff);
+	a.Jmp(loop);
+	a.Addu(s3, s3, v0);
+}
+
+// Every load and store width, including an unaligned lwl/lwr pair, walking a 16KiB buffer
+static void LoadStore(Assembler& a)
+{
+	a.Li(s0, data_addr);
+	a.Addu(a0, s0, zero);
+
+	int loop = a.Here();
+	a.Lw(t0, 0, a0);
+	a.Lh(t1, 6, a0);
+	a.Lbu(t2, 3, a0);
+	a.Lhu(t3, 10, a0);
+	a.Lb(t4, 13, a0);
+	a.Addu(t5, t0, t1);
+	a.Sw(t5, 8, a0);
+	a.Sh(t2, 12, a0);
+	a.Sb(t0, 15, a0);
+	a.Lwl(t6, 19, a0);
+	a.Lwr(t6, 16, a0);
+	a.Addu(t7, t3, t4);
+	a.Addu(t7, t7, t6);
+	a.Sw(t7, 20, a0);
+	a.Addiu(a0, a0, 32);
+	a.Andi(a0, a0, 0x3fe0);
+	a.Jmp(loop);
+	a.Or(a0, a0, s0);
+}
+
+struct Workload
+{
+	const char* name;
+	void (*build)(Assembler& a);
+};
+
+static const Workload workloads[] = {
+	{"alu", Alu},
+	{"branchy", Branchy},
+	{"memcpy", Memcpy},
+	{"calls", Calls},
+	{"loadstore", LoadStore},
+};
+
+struct Result
+{
+	const char* name;
+	uint64_t instrs;
+	double seconds;
+	uint64_t compiled, lookups, hits;
+};
+
+// Same loop as CPU::Clock, without a BIOS behind it
+static void RunTo(uint64_t instrs)
+{
+	while (g_state.cycles < instrs)
+	{
+		cycle_deadline = std::min(g_state.cycles + frame_cycles, instrs);
+
+		while (g_state.cycles < cycle_deadline)
+		{
+			auto func = Bus::recomp->LookupBlock(g_state.pc);
+
+			if (!func)
+				func = Bus::recomp->Compile(g_state.pc, max_block_instrs);
+
+			func();
+		}
+	}
+}
+
+int Bench::Run(const std::string& out_path, uint64_t instrs)
+{
+	using clock = std::chrono::steady_clock;
+
+	std::vector<Result> results;
+
+	for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+	{
+		uint32_t base = code_addr + i * code_stride;
+		Assembler a(base);
+		workloads[i].build(a);
+		memcpy(Bus::GetRAM(base, a.code.size() * 4), a.code.data(), a.code.size() * 4);
+
+		// Every workload starts from reset, none of them use the MDU, so a cycle is an instruction
+		memset(&g_state, 0, sizeof(g_state));
+		g_state.regs[sp] = stack_top;
+		g_state.pc = base;
+		g_state.next_pc = base + 4;
+		load_delay_slot = next_load_delay = {0, 0};
+
+		CPURecompiler::Stats before = Bus::recomp->stats;
+		auto start = clock::now();
+		RunTo(instrs);
+		auto end = clock::now();
+		CPURecompiler::Stats after = Bus::recomp->stats;
+
+		results.push_back({workloads[i].name, g_state.cycles, std::chrono::duration<double>(end - start).count(),
+			after.compiled - before.compiled, after.lookups - before.lookups, after.hits - before.hits});
+	}
+
+	FILE* out = fopen(out_path.c_str(), "w");
+	if (!out)
+	{
+		log("Couldn't open %s\n", out_path.c_str());
+		return 1;
+	}
+
+	fprintf(out, "{\n\t\"instrs_per_workload\": %llu,\n\t\"workloads\": [\n", (unsigned long long)instrs);
+
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const Result& r = results[i];
+		double mips = r.instrs / r.seconds / 1e6;
+		double ns = r.seconds * 1e9 / r.instrs;
+		double hit_rate = r.lookups ? (double)r.hits / r.lookups : 0;
+
+		log("%-10s %8.1f guest MIPS %7.2f ns/instr %4llu blocks %5.1f%% hit rate\n", r.name, mips, ns,
+			(unsigned long long)r.compiled, hit_rate * 100);
+
+		fprintf(out, "\t\t{\"name\": \"%s\", \"guest_instrs\": %llu, \"seconds\": %.6f, \"guest_mips\": %.2f, "
+			"\"host_ns_per_instr\": %.3f, \"blocks_compiled\": %llu, \"lookups\": %llu, \"cache_hit_rate\": %.4f}%s\n",
+			r.name, (unsigned long long)r.instrs, r.seconds, mips, ns, (unsigned long long)r.compiled,
+			(unsigned long long)r.lookups, hit_rate, i + 1 < results.size() ? "," : "");
+	}
+
+	fprintf(out, "\t]\n}\n");
+	fclose(out);
+
+	return 0;
+}
+
+int Bench::RunCompile(const std::string& out_path, int rounds)
+{
+	using clock = std::chrono::steady_clock;
+
+	std::vector<uint32_t> corpus = Precompile::DiscoverBIOS(max_block_instrs);
+	if (corpus.empty())
+	{
+		log("No blocks found in the BIOS\n");
+		return 1;
+	}
+
+	// After the first round every compile also replaces the block from the round before
+	CPURecompiler::Stats before = Bus::recomp->stats;
+	auto start = clock::now();
+	for (int r = 0; r < rounds; r++)
+	{
+		for (uint32_t pc : corpus)
+			Bus::recomp->Compile(pc, max_block_instrs);
+	}
+	double seconds = std::chrono::duration<double>(clock::now() - start).count();
+	CPURecompiler::Stats after = Bus::recomp->stats;
+
+	uint64_t compiled = after.compiled - before.compiled;
+	uint64_t instrs = after.compiled_instrs - before.compiled_instrs;
+	double blocks_per_sec = compiled / seconds;
+	double ns = seconds * 1e9 / instrs;
+
+	log("%zu blocks x %d rounds: %.0f blocks/s, %.1f ns per guest instruction\n", corpus.size(), rounds, blocks_per_sec, ns);
+
+	FILE* out = fopen(out_path.c_str(), "w");
+	if (!out)
+	{
+		log("Couldn't open %s\n", out_path.c_str());
+		return 1;
+	}
+
+	fprintf(out, "{\n\t\"corpus_blocks\": %zu,\n\t\"rounds\": %d,\n\t\"blocks_compiled\": %llu,\n\t\"guest_instrs\": %llu,\n"
+		"\t\"seconds\": %.6f,\n\t\"blocks_per_sec\": %.1f,\n\t\"ns_per_guest_instr\": %.3f\n}\n",
+		corpus.size(), rounds, (unsigned long long)compiled, (unsigned long long)instrs, seconds, blocks_per_sec, ns);
+	fclose(out);
+
+	return 0;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Benchmarks for keeping track of the emulator's speed. All of them write their results
+// to out_path as JSON, and return non-zero if they couldn't
+namespace Bench
+{
+	// Runs a set of small synthetic programs straight from RAM, each to a fixed
+	// number of guest instructions
+	int Run(const std::string& out_path, uint64_t instrs);
+
+	// Compiles every block Precompile finds in the loaded BIOS, rounds times over
+	int RunCompile(const std::string& out_path, int rounds);
+
+	// Times Bus reads and writes of each width, mask_region and MarkBlockDirty,
+	// over addresses in each part of the memory map and a made up BIOS-like trace
+	int RunMemory(const std::string& out_path);
+};
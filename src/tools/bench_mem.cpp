@@ -0,0 +1,329 @@
+// <random> pulls in <cmath>, which has to come before the log macro
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <tools/bench.h>
+#include <cpu/cpu_core.h>
+#include <cpu/cpu_ops.h>
+#include <memory/Bus.h>
+#include <util/log.h>
+
+#define MODULE "Bench"
+
+static constexpr int trace_size = 0x10000;
+static constexpr uint64_t accesses = 1 << 24; // Per case, going round the addresses as many times as that takes
+
+// Where the code_page mix puts its blocks. There are as many as the recompiler keeps,
+// and the mix writes past them, so every write checks a full cache and hits nothing
+static constexpr uint32_t code_page = 0x80010000;
+static constexpr size_t code_page_blocks = CPURecompiler::max_ram_blocks;
+
+// Stores to these are dropped by Bus::write, and loads from them panic
+static const uint32_t ignored_mmio[] = {
+	0x1f801000, 0x1f801004, 0x1f801008, 0x1f80100c, 0x1f801010, 0x1f801014, 0x1f801018, 0x1f80101c, 0x1f801020,
+	0x1f801060, 0x1f801c00, 0x1f801c10, 0x1f801d00, 0x1f801d70, 0x1f801d80, 0x1f801d88, 0x1f801dac, 0xfffe0130,
+};
+
+// Branch misses in user code between Start and Stop, where the kernel lets us have a counter
+class BranchMisses
+{
+private:
+	int fd = -1;
+public:
+	BranchMisses()
+	{
+#ifdef __linux__
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+	}
+
+	~BranchMisses()
+	{
+#ifdef __linux__
+		if (fd >= 0)
+			close(fd);
+#endif
+	}
+
+	bool Available() { return fd >= 0; }
+
+	void Start()
+	{
+#ifdef __linux__
+		if (fd < 0)
+			return;
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+	}
+
+	uint64_t Stop()
+	{
+		uint64_t count = 0;
+#ifdef __linux__
+		if (fd < 0 || ioctl(fd, PERF_EVENT_IOC_DISABLE, 0) < 0 || read(fd, &count, sizeof(count)) != sizeof(count))
+			return 0;
+#endif
+		return count;
+	}
+};
+
+enum Op
+{
+	op_read,
+	op_write,
+	op_mask, // Bus::mask_region on its own
+	op_dirty, // CPURecompiler::MarkBlockDirty on its own
+	op_mixed, // Whatever each trace entry says
+};
+
+static const char* op_names[] = {"read", "write", "mask_region", "mark_dirty", "mixed"};
+
+// An access in a trace. Plain mixes only use the address
+struct Access
+{
+	uint32_t addr;
+	uint8_t size;
+	bool write;
+};
+
+struct MemResult
+{
+	std::string mix;
+	Op op;
+	int size;
+	double ns;
+	double misses; // Per access, negative if there's no counter
+};
+
+// Addresses aligned to size, spread over the KUSEG, KSEG0 and KSEG1 mirrors of [start, start + len)
+static std::vector<Access> Mix(std::mt19937& rng, uint32_t start, uint32_t len, int size, bool mirrors)
+{
+	static const uint32_t segments[] = {0x00000000, 0x80000000, 0xa0000000};
+	std::vector<Access> out(trace_size);
+
+	for (auto& a : out)
+	{
+		uint32_t offset = (rng() % len) & ~(size - 1);
+		a.addr = (start + offset) | (mirrors ? segments[rng() % 3] : 0);
+		a.size = size;
+		a.write = false;
+	}
+
+	return out;
+}
+
+// Roughly what the BIOS does between frames: mostly walking through RAM, stack
+// traffic, constants read from ROM, and the odd store to a register we ignore
+static std::vector<Access> Trace(std::mt19937& rng)
+{
+	std::vector<Access> out(trace_size);
+	uint32_t ptr = 0x80020000, sp = 0x801ffe00, rom = 0xbfc10000;
+
+	for (auto& a : out)
+	{
+		static const uint8_t sizes[] = {1, 2, 4, 4};
+		uint32_t kind = rng() % 100;
+		a.size = sizes[rng() % 4];
+		a.write = false;
+
+		if (kind < 55)
+		{
+			ptr = 0x80020000 + ((ptr + a.size) & 0x3ffff);
+			a.addr = ptr;
+			a.write = kind < 15;
+		}
+		else if (kind < 80)
+		{
+			a.size = 4;
+			a.addr = sp - (rng() % 16) * 4;
+			a.write = kind < 68;
+		}
+		else if (kind < 95)
+		{
+			a.size = 4;
+			rom = 0xbfc10000 + ((rom + 4) & 0xffff);
+			a.addr = rom;
+		}
+		else
+		{
+			a.size = 4;
+			a.addr = ignored_mmio[rng() % (sizeof(ignored_mmio) / sizeof(ignored_mmio[0]))];
+			a.write = true;
+		}
+
+		a.addr &= ~(uint32_t)(a.size - 1);
+	}
+
+	return out;
+}
+
+template<typename T>
+static uint64_t RunOp(const std::vector<Access>& addrs, Op op)
+{
+	uint64_t sink = 0;
+
+	for (uint64_t n = 0; n < accesses; n++)
+	{
+		const Access& a = addrs[n & (trace_size - 1)];
+
+		switch (op)
+		{
+		case op_read:
+			sink += Bus::read<T>(a.addr);
+			break;
+		case op_write:
+			Bus::write<T>(a.addr, (T)n);
+			break;
+		case op_mask:
+			sink += Bus::mask_region(a.addr);
+			break;
+		case op_dirty:
+			Bus::recomp->MarkBlockDirty(Bus::mask_region(a.addr));
+			break;
+		case op_mixed:
+			if (a.write)
+			{
+				if (a.size == 1)
+					Bus::Write8(a.addr, n);
+				else if (a.size == 2)
+					Bus::Write16(a.addr, n);
+				else
+					Bus::Write32(a.addr, n);
+			}
+			else
+			{
+				if (a.size == 1)
+					sink += Bus::Read8(a.addr);
+				else if (a.size == 2)
+					sink += Bus::Read16(a.addr);
+				else
+					sink += Bus::Read32(a.addr);
+			}
+			break;
+		}
+	}
+
+	return sink;
+}
+
+// Puts small functions at the start of code_page, each compiled into its own block
+static void FillCodePage()
+{
+	for (size_t i = 0; i < code_page_blocks; i++)
+	{
+		uint32_t pc = code_page + i * 16;
+		uint32_t code[4] = {
+			(Instructions::addiu << 26) | (2 << 21) | (2 << 16) | 1, // addiu $v0, $v0, 1
+			(31 << 21) | SpecialInstructions::jr, // jr $ra
+			0,
+			0,
+		};
+
+		memcpy(Bus::GetRAM(pc, sizeof(code)), code, sizeof(code));
+		Bus::recomp->Compile(pc, max_block_instrs);
+	}
+}
+
+int Bench::RunMemory(const std::string& out_path)
+{
+	using clock = std::chrono::steady_clock;
+
+	std::mt19937 rng(1);
+	BranchMisses counter;
+	std::vector<MemResult> results;
+	volatile uint64_t sink = 0;
+
+	auto run = [&](const std::string& mix, const std::vector<Access>& addrs, Op op, int size)
+	{
+		counter.Start();
+		auto start = clock::now();
+
+		if (size == 1)
+			sink = sink + RunOp<uint8_t>(addrs, op);
+		else if (size == 2)
+			sink = sink + RunOp<uint16_t>(addrs, op);
+		else
+			sink = sink + RunOp<uint32_t>(addrs, op);
+
+		double seconds = std::chrono::duration<double>(clock::now() - start).count();
+		uint64_t misses = counter.Stop();
+
+		results.push_back({mix, op, size, seconds * 1e9 / accesses, counter.Available() ? (double)misses / accesses : -1});
+	};
+
+	for (int size : {1, 2, 4})
+	{
+		// Stay clear of the bottom of RAM, where a write to 0xC0 gets printed
+		auto ram = Mix(rng, 0x10000, 0x1f0000, size, true);
+		auto bios = Mix(rng, 0x1fc00000, 0x80000, size, true);
+		auto expansion = Mix(rng, 0x1f000000, 0x80000, size, false);
+
+		std::vector<Access> mmio(trace_size);
+		for (auto& a : mmio)
+			a = {ignored_mmio[rng() % (sizeof(ignored_mmio) / sizeof(ignored_mmio[0]))], (uint8_t)size, true};
+
+		run("ram", ram, op_read, size);
+		run("ram", ram, op_write, size);
+		run("bios", bios, op_read, size);
+		run("expansion", expansion, op_read, size);
+		run("mmio", mmio, op_write, size);
+	}
+
+	auto ram = Mix(rng, 0x10000, 0x1f0000, 4, true);
+	run("ram", ram, op_mask, 4);
+	run("ram", ram, op_dirty, 4);
+	run("trace", Trace(rng), op_mixed, 0);
+
+	// Last, so the blocks don't slow down the writes above
+	FillCodePage();
+	auto code = Mix(rng, Bus::mask_region(code_page) + 0x800, 0x800, 4, true);
+	run("code_page", code, op_dirty, 4);
+	run("code_page", code, op_write, 4);
+
+	FILE* out = fopen(out_path.c_str(), "w");
+	if (!out)
+	{
+		log("Couldn't open %s\n", out_path.c_str());
+		return 1;
+	}
+
+	fprintf(out, "{\n\t\"accesses_per_case\": %llu,\n\t\"branch_misses_counted\": %s,\n\t\"cases\": [\n",
+		(unsigned long long)accesses, counter.Available() ? "true" : "false");
+
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const MemResult& r = results[i];
+		char misses[32] = "null";
+		if (r.misses >= 0)
+			snprintf(misses, sizeof(misses), "%.4f", r.misses);
+
+		log("%-10s %-11s %d: %6.2f ns/access, %s branch misses/access\n", r.mix.c_str(), op_names[r.op], r.size, r.ns, misses);
+
+		fprintf(out, "\t\t{\"mix\": \"%s\", \"op\": \"%s\", \"size\": %d, \"ns_per_access\": %.3f, \"branch_misses_per_access\": %s}%s\n",
+			r.mix.c_str(), op_names[r.op], r.size, r.ns, misses, i + 1 < results.size() ? "," : "");
+	}
+
+	fprintf(out, "\t]\n}\n");
+	fclose(out);
+
+	return 0;
+}
@@ -0,0 +1,683 @@
+// <random> pulls in <cmath>, which has to come before the log macro
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <tools/fuzz.h>
+#include <cpu/cpu_core.h>
+#include <cpu/cpu_ops.h>
+#include <memory/Bus.h>
+#include <util/log.h>
+
+#define MODULE "Fuzz"
+
+// The code gets a page to itself, and every load and store is relative to $gp,
+// which points at the middle of a separate data window
+static constexpr uint32_t code_addr = 0x80080000;
+static constexpr uint32_t code_size = 0x1000;
+static constexpr uint32_t data_addr = 0x80100000;
+static constexpr uint32_t data_size = 0x1000;
+static constexpr int gp = 28;
+static constexpr int max_body = 24;
+static constexpr int max_reports = 10;
+
+struct RefState
+{
+	uint32_t regs[32];
+	uint32_t cop0[32];
+	uint32_t pc, next_pc;
+	uint32_t hi, lo;
+	uint64_t cycles, mdu_ready;
+	LoadDelaySlot delay, next_delay;
+	uint8_t mem[data_size];
+};
+
+static uint32_t DataOffset(uint32_t addr)
+{
+	return Bus::mask_region(addr) - Bus::mask_region(data_addr);
+}
+
+template<typename T>
+static T Load(RefState& s, uint32_t addr)
+{
+	T value;
+	memcpy(&value, &s.mem[DataOffset(addr)], sizeof(T));
+	return value;
+}
+
+template<typename T>
+static void Store(RefState& s, uint32_t addr, T value)
+{
+	memcpy(&s.mem[DataOffset(addr)], &value, sizeof(T));
+}
+
+static uint32_t MultLatency(uint32_t magnitude)
+{
+	if (magnitude >= 0x100000)
+		return 13;
+	if (magnitude >= 0x800)
+		return 9;
+	return 6;
+}
+
+// One instruction, written from the R3000A's documented behaviour rather than
+// from the recompiler. Loads land after the next instruction, the same way
+// HandleLoadDelay does it. index is the instruction's position in the block
+static void Step(RefState& s, uint32_t instr, int index)
+{
+	Opcode o;
+	o.full = instr;
+
+	uint32_t rs = s.regs[o.r_type.rs];
+	uint32_t rt = s.regs[o.r_type.rt];
+	int32_t simm = (int16_t)o.i_type.imm;
+	uint32_t addr = rs + simm;
+	uint64_t now = s.cycles + index;
+	uint32_t pc = s.pc;
+
+	s.pc = s.next_pc;
+	s.next_pc += 4;
+
+	auto set = [&](int reg, uint32_t value)
+	{
+		if (reg)
+			s.regs[reg] = value;
+	};
+
+	auto load = [&](uint32_t value)
+	{
+		s.next_delay = {(int)o.i_type.rt, value};
+	};
+
+	// Reading hi or lo stalls until the multiply or divide before it is done
+	auto wait = [&]()
+	{
+		if (s.mdu_ready > now)
+			s.cycles += s.mdu_ready - now;
+	};
+
+	switch (o.opcode)
+	{
+	case Instructions::special:
+		switch (o.r_type.func)
+		{
+		case SpecialInstructions::sll:
+			set(o.r_type.rd, rt << o.r_type.sa);
+			break;
+		case SpecialInstructions::srl:
+			set(o.r_type.rd, rt >> o.r_type.sa);
+			break;
+		case SpecialInstructions::sra:
+			set(o.r_type.rd, (int32_t)rt >> o.r_type.sa);
+			break;
+		case SpecialInstructions::sllv:
+			set(o.r_type.rd, rt << (rs & 31));
+			break;
+		case SpecialInstructions::srlv:
+			set(o.r_type.rd, rt >> (rs & 31));
+			break;
+		case SpecialInstructions::srav:
+			set(o.r_type.rd, (int32_t)rt >> (rs & 31));
+			break;
+		case SpecialInstructions::jr:
+			s.next_pc = rs;
+			break;
+		case SpecialInstructions::jalr:
+			s.next_pc = rs;
+			set(o.r_type.rd, pc + 8);
+			break;
+		case SpecialInstructions::mfhi:
+			wait();
+			set(o.r_type.rd, s.hi);
+			break;
+		case SpecialInstructions::mthi:
+			s.hi = rs;
+			break;
+		case SpecialInstructions::mflo:
+			wait();
+			set(o.r_type.rd, s.lo);
+			break;
+		case SpecialInstructions::mtlo:
+			s.lo = rs;
+			break;
+		case SpecialInstructions::mult:
+		{
+			int64_t r = (int64_t)(int32_t)rs * (int32_t)rt;
+			s.lo = r;
+			s.hi = r >> 32;
+			s.mdu_ready = now + MultLatency(rs ^ ((int32_t)rs >> 31));
+			break;
+		}
+		case SpecialInstructions::multu:
+		{
+			uint64_t r = (uint64_t)rs * rt;
+			s.lo = r;
+			s.hi = r >> 32;
+			s.mdu_ready = now + MultLatency(rs);
+			break;
+		}
+		case SpecialInstructions::div_:
+			if (rt == 0)
+			{
+				s.hi = rs;
+				s.lo = (int32_t)rs < 0 ? 1 : -1;
+			}
+			else if (rs == 0x80000000 && rt == 0xffffffff)
+			{
+				s.hi = 0;
+				s.lo = 0x80000000;
+			}
+			else
+			{
+				s.hi = (int32_t)rs % (int32_t)rt;
+				s.lo = (int32_t)rs / (int32_t)rt;
+			}
+			s.mdu_ready = now + 36;
+			break;
+		case SpecialInstructions::divu:
+			s.hi = rt ? rs % rt : rs;
+			s.lo = rt ? rs / rt : 0xffffffff;
+			s.mdu_ready = now + 36;
+			break;
+		case SpecialInstructions::addu:
+			set(o.r_type.rd, rs + rt);
+			break;
+		case SpecialInstructions::and_:
+			set(o.r_type.rd, rs & rt);
+			break;
+		case SpecialInstructions::or_:
+			set(o.r_type.rd, rs | rt);
+			break;
+		case SpecialInstructions::sltiu:
+			set(o.r_type.rd, rs < rt);
+			break;
+		}
+		break;
+	case Instructions::j:
+		s.next_pc = (s.pc & 0xf0000000) | (o.j_type.target << 2);
+		break;
+	case Instructions::jal:
+		s.next_pc = (s.pc & 0xf0000000) | (o.j_type.target << 2);
+		set(31, pc + 8);
+		break;
+	case Instructions::beq:
+		if (rs == rt)
+			s.next_pc = s.pc + (simm << 2);
+		break;
+	case Instructions::bne:
+		if (rs != rt)
+			s.next_pc = s.pc + (simm << 2);
+		break;
+	case Instructions::addi: // Overflow isn't trapped, same as the recompiler
+	case Instructions::addiu:
+		set(o.i_type.rt, addr);
+		break;
+	case Instructions::andi:
+		set(o.i_type.rt, rs & o.i_type.imm);
+		break;
+	case Instructions::ori:
+		set(o.i_type.rt, rs | o.i_type.imm);
+		break;
+	case Instructions::lui:
+		set(o.i_type.rt, o.i_type.imm << 16);
+		break;
+	case Instructions::cop0:
+		// Moves from cop0 have no load delay in this emulator
+		if (o.r_type.rs == Cop0Instructions::mfc0)
+			set(o.r_type.rt, s.cop0[o.r_type.rd]);
+		else
+			s.cop0[o.r_type.rd] = rt;
+		break;
+	case Instructions::lb:
+		load((int8_t)Load<uint8_t>(s, addr));
+		break;
+	case Instructions::lbu:
+		load(Load<uint8_t>(s, addr));
+		break;
+	case Instructions::lh:
+		load((int16_t)Load<uint16_t>(s, addr));
+		break;
+	case Instructions::lhu:
+		load(Load<uint16_t>(s, addr));
+		break;
+	case Instructions::lw:
+		load(Load<uint32_t>(s, addr));
+		break;
+	case Instructions::lwl:
+	case Instructions::lwr:
+	{
+		// Merges with a load into rt that hasn't landed yet
+		uint32_t cur = s.delay.reg == o.i_type.rt ? s.delay.data : rt;
+		uint32_t word = Load<uint32_t>(s, addr & ~3);
+		static const uint32_t left_mask[4] = {0x00ffffff, 0x0000ffff, 0x000000ff, 0};
+		static const uint32_t right_mask[4] = {0, 0xff000000, 0xffff0000, 0xffffff00};
+		int n = addr & 3;
+
+		if (o.opcode == Instructions::lwl)
+			load((cur & left_mask[n]) | (word << ((3 - n) * 8)));
+		else
+			load((cur & right_mask[n]) | (word >> (n * 8)));
+		break;
+	}
+	case Instructions::sb:
+		Store<uint8_t>(s, addr, rt);
+		break;
+	case Instructions::sh:
+		Store<uint16_t>(s, addr, rt);
+		break;
+	case Instructions::sw:
+		Store<uint32_t>(s, addr, rt);
+		break;
+	case Instructions::swl:
+	case Instructions::swr:
+	{
+		uint32_t word = Load<uint32_t>(s, addr & ~3);
+		static const uint32_t left_mask[4] = {0xffffff00, 0xffff0000, 0xff000000, 0};
+		static const uint32_t right_mask[4] = {0, 0x000000ff, 0x0000ffff, 0x00ffffff};
+		int n = addr & 3;
+
+		if (o.opcode == Instructions::swl)
+			word = (word & left_mask[n]) | (rt >> ((3 - n) * 8));
+		else
+			word = (word & right_mask[n]) | (rt << (n * 8));
+		Store<uint32_t>(s, addr & ~3, word);
+		break;
+	}
+	}
+
+	if (s.delay.reg)
+		s.regs[s.delay.reg] = s.delay.data;
+	s.delay = s.next_delay;
+	s.next_delay = {0, 0};
+}
+
+static std::string Disassemble(uint32_t instr)
+{
+	Opcode o;
+	o.full = instr;
+	char buf[64];
+	const char* rs = GetRegName(o.r_type.rs);
+	const char* rt = GetRegName(o.r_type.rt);
+	const char* rd = GetRegName(o.r_type.rd);
+	int32_t simm = (int16_t)o.i_type.imm;
+
+	if (!instr)
+		return "nop";
+
+	switch (o.opcode)
+	{
+	case Instructions::special:
+	{
+		static const char* shifts[] = {"sll", "", "srl", "sra", "sllv", "", "srlv", "srav"};
+		switch (o.r_type.func)
+		{
+		case SpecialInstructions::sll:
+		case SpecialInstructions::srl:
+		case SpecialInstructions::sra:
+			snprintf(buf, sizeof(buf), "%s %s, %s, %d", shifts[o.r_type.func], rd, rt, o.r_type.sa);
+			break;
+		case SpecialInstructions::sllv:
+		case SpecialInstructions::srlv:
+		case SpecialInstructions::srav:
+			snprintf(buf, sizeof(buf), "%s %s, %s, %s", shifts[o.r_type.func], rd, rt, rs);
+			break;
+		case SpecialInstructions::jr:
+			snprintf(buf, sizeof(buf), "jr %s", rs);
+			break;
+		case SpecialInstructions::jalr:
+			snprintf(buf, sizeof(buf), "jalr %s, %s", rd, rs);
+			break;
+		case SpecialInstructions::mfhi:
+			snprintf(buf, sizeof(buf), "mfhi %s", rd);
+			break;
+		case SpecialInstructions::mflo:
+			snprintf(buf, sizeof(buf), "mflo %s", rd);
+			break;
+		case SpecialInstructions::mthi:
+			snprintf(buf, sizeof(buf), "mthi %s", rs);
+			break;
+		case SpecialInstructions::mtlo:
+			snprintf(buf, sizeof(buf), "mtlo %s", rs);
+			break;
+		case SpecialInstructions::mult:
+			snprintf(buf, sizeof(buf), "mult %s, %s", rs, rt);
+			break;
+		case SpecialInstructions::multu:
+			snprintf(buf, sizeof(buf), "multu %s, %s", rs, rt);
+			break;
+		case SpecialInstructions::div_:
+			snprintf(buf, sizeof(buf), "div %s, %s", rs, rt);
+			break;
+		case SpecialInstructions::divu:
+			snprintf(buf, sizeof(buf), "divu %s, %s", rs, rt);
+			break;
+		case SpecialInstructions::addu:
+			snprintf(buf, sizeof(buf), "addu %s, %s, %s", rd, rs, rt);
+			break;
+		case SpecialInstructions::and_:
+			snprintf(buf, sizeof(buf), "and %s, %s, %s", rd, rs, rt);
+			break;
+		case SpecialInstructions::or_:
+			snprintf(buf, sizeof(buf), "or %s, %s, %s", rd, rs, rt);
+			break;
+		case SpecialInstructions::sltiu:
+			snprintf(buf, sizeof(buf), "sltu %s, %s, %s", rd, rs, rt);
+			break;
+		default:
+			snprintf(buf, sizeof(buf), "0x%08x", instr);
+		}
+		break;
+	}
+	case Instructions::j:
+	case Instructions::jal:
+		snprintf(buf, sizeof(buf), "%s 0x%08x", o.opcode == Instructions::j ? "j" : "jal", o.j_type.target << 2);
+		break;
+	case Instructions::beq:
+	case Instructions::bne:
+		snprintf(buf, sizeof(buf), "%s %s, %s, %d", o.opcode == Instructions::beq ? "beq" : "bne", rs, rt, simm);
+		break;
+	case Instructions::addi:
+	case Instructions::addiu:
+		snprintf(buf, sizeof(buf), "%s %s, %s, %d", o.opcode == Instructions::addi ? "addi" : "addiu", rt, rs, simm);
+		break;
+	case Instructions::andi:
+	case Instructions::ori:
+		snprintf(buf, sizeof(buf), "%s %s, %s, 0x%04x", o.opcode == Instructions::andi ? "andi" : "ori", rt, rs, o.i_type.imm);
+		break;
+	case Instructions::lui:
+		snprintf(buf, sizeof(buf), "lui %s, 0x%04x", rt, o.i_type.imm);
+		break;
+	case Instructions::cop0:
+		snprintf(buf, sizeof(buf), "%s %s, r%d", o.r_type.rs == Cop0Instructions::mfc0 ? "mfc0" : "mtc0", rt, o.r_type.rd);
+		break;
+	default:
+	{
+		static const char* mem[] = {"lb", "lh", "lwl", "lw", "lbu", "lhu", "lwr", "", "sb", "sh", "swl", "sw", "", "", "swr"};
+		if (o.opcode >= Instructions::lb && o.opcode <= Instructions::swr)
+			snprintf(buf, sizeof(buf), "%s %s, %d(%s)", mem[o.opcode - Instructions::lb], rt, simm, rs);
+		else
+			snprintf(buf, sizeof(buf), "0x%08x", instr);
+	}
+	}
+
+	return buf;
+}
+
+class Generator
+{
+	std::mt19937 rng;
+
+	uint32_t Range(uint32_t n) { return rng() % n; }
+
+	// Any register, including $gp and $zero
+	int Src() { return Range(32); }
+	// Anything but $gp, which has to keep pointing at the data window
+	int Dst()
+	{
+		int r = Range(32);
+		return r == gp ? 0 : r;
+	}
+
+	static uint32_t R(int func, int rs, int rt, int rd, int sa = 0)
+	{
+		return (rs << 21) | (rt << 16) | (rd << 11) | (sa << 6) | func;
+	}
+
+	static uint32_t I(int op, int rs, int rt, uint16_t imm)
+	{
+		return (op << 26) | (rs << 21) | (rt << 16) | imm;
+	}
+
+public:
+	Generator(uint32_t seed) : rng(seed) {}
+
+	// Values that tend to find edge cases, mixed with plain random ones
+	uint32_t Value()
+	{
+		static const uint32_t special[] = {0, 1, 2, 0xffffffff, 0x80000000, 0x7fffffff, 0x7ff, 0x800, 0xfffff, 0x100000, 0xffff8000};
+		switch (Range(4))
+		{
+		case 0:
+			return special[Range(sizeof(special) / sizeof(special[0]))];
+		case 1:
+			return Range(64);
+		default:
+			return rng();
+		}
+	}
+
+	// Anything the recompiler supports that doesn't change the PC
+	uint32_t Body()
+	{
+		uint16_t imm = Range(2) ? rng() : Range(64);
+
+		switch (Range(40))
+		{
+		case 0: return 0;
+		case 1: return R(SpecialInstructions::sll, 0, Src(), Dst(), Range(32));
+		case 2: return R(SpecialInstructions::srl, 0, Src(), Dst(), Range(32));
+		case 3: return R(SpecialInstructions::sra, 0, Src(), Dst(), Range(32));
+		case 4: return R(SpecialInstructions::sllv, Src(), Src(), Dst());
+		case 5: return R(SpecialInstructions::srlv, Src(), Src(), Dst());
+		case 6: return R(SpecialInstructions::srav, Src(), Src(), Dst());
+		case 7: return R(SpecialInstructions::mfhi, 0, 0, Dst());
+		case 8: return R(SpecialInstructions::mflo, 0, 0, Dst());
+		case 9: return R(SpecialInstructions::mthi, Src(), 0, 0);
+		case 10: return R(SpecialInstructions::mtlo, Src(), 0, 0);
+		case 11: return R(SpecialInstructions::mult, Src(), Src(), 0);
+		case 12: return R(SpecialInstructions::multu, Src(), Src(), 0);
+		case 13: return R(SpecialInstructions::div_, Src(), Src(), 0);
+		case 14: return R(SpecialInstructions::divu, Src(), Src(), 0);
+		case 15: case 16: return R(SpecialInstructions::addu, Src(), Src(), Dst());
+		case 17: return R(SpecialInstructions::and_, Src(), Src(), Dst());
+		case 18: return R(SpecialInstructions::or_, Src(), Src(), Dst());
+		case 19: return R(SpecialInstructions::sltiu, Src(), Src(), Dst());
+		case 20: return I(Instructions::addi, Src(), Dst(), imm);
+		case 21: case 22: return I(Instructions::addiu, Src(), Dst(), imm);
+		case 23: return I(Instructions::andi, Src(), Dst(), imm);
+		case 24: return I(Instructions::ori, Src(), Dst(), imm);
+		case 25: return I(Instructions::lui, 0, Dst(), imm);
+		// SR is left alone, since setting IsC changes what a store does
+		case 26: return I(Instructions::cop0, Cop0Instructions::mfc0, Dst(), Range(32) << 11);
+		case 27:
+		{
+			int reg = Range(32);
+			return I(Instructions::cop0, Cop0Instructions::mtc0, Src(), (reg == 12 ? 3 : reg) << 11);
+		}
+		default:
+		{
+			// Loads and stores into the data window, aligned unless they're lwl/lwr/swl/swr
+			static const uint8_t ops[] = {Instructions::lb, Instructions::lbu, Instructions::lh, Instructions::lhu, Instructions::lw,
+				Instructions::lwl, Instructions::lwr, Instructions::sb, Instructions::sh, Instructions::sw, Instructions::swl, Instructions::swr};
+			uint8_t op = ops[Range(sizeof(ops))];
+			int32_t offset = (int32_t)Range(data_size - 4) - (int32_t)(data_size / 2);
+			if (op == Instructions::lh || op == Instructions::lhu || op == Instructions::sh)
+				offset &= ~1;
+			if (op == Instructions::lw || op == Instructions::sw)
+				offset &= ~3;
+			bool store = op >= Instructions::sb;
+			return I(op, gp, store ? Src() : Dst(), offset);
+		}
+		}
+	}
+
+	// A branch at index out of n, which never goes back to the start of the block,
+	// since that would make it a loop
+	uint32_t Branch(int index)
+	{
+		switch (Range(6))
+		{
+		case 0:
+		case 1:
+		{
+			int32_t offset;
+			do
+				offset = (int32_t)Range(48) - 24;
+			while (index + 1 + offset == 0);
+			return I(Range(2) ? Instructions::beq : Instructions::bne, Src(), Range(4) ? Src() : 0, offset);
+		}
+		case 2:
+			return (Instructions::j << 26) | (((code_addr & 0x0ffffff0) >> 2) + 4 + Range(0x100));
+		case 3:
+			return (Instructions::jal << 26) | (((code_addr & 0x0ffffff0) >> 2) + 4 + Range(0x100));
+		case 4:
+			return R(SpecialInstructions::jr, Src(), 0, 0);
+		default:
+			return R(SpecialInstructions::jalr, Src(), 0, Dst());
+		}
+	}
+
+	std::vector<uint32_t> Sequence(bool& branch)
+	{
+		std::vector<uint32_t> code;
+		int n = 1 + Range(max_body);
+
+		for (int i = 0; i < n; i++)
+			code.push_back(Body());
+
+		branch = Range(2);
+		if (branch)
+		{
+			code.push_back(Branch(n));
+			code.push_back(Body());
+		}
+
+		return code;
+	}
+
+	void State(RefState& s)
+	{
+		memset(&s, 0, sizeof(s));
+		for (int i = 1; i < 32; i++)
+			s.regs[i] = Value();
+		for (int i = 0; i < 32; i++)
+			s.cop0[i] = Value();
+		s.regs[gp] = data_addr + data_size / 2;
+		s.cop0[12] &= ~0x10000;
+		s.pc = code_addr;
+		s.next_pc = code_addr + 4;
+		s.hi = Value();
+		s.lo = Value();
+		s.cycles = 1000 + Range(1000);
+		s.mdu_ready = s.cycles + Range(40);
+		// Sometimes start with a load left pending by the block before
+		if (Range(4) == 0)
+			s.delay = {Dst(), Value()};
+		for (auto& b : s.mem)
+			b = rng();
+	}
+};
+
+static void Report(uint32_t seed, int index, const std::vector<uint32_t>& code, const RefState& start, const RefState& ref)
+{
+	log("Case %d (seed %u) doesn't match\n", index, seed);
+	for (size_t i = 0; i < code.size(); i++)
+		printf("\t0x%08x: %08x  %s\n", (uint32_t)(code_addr + i * 4), code[i], Disassemble(code[i]).c_str());
+
+	auto diff = [](const char* name, uint64_t before, uint64_t expected, uint64_t actual)
+	{
+		if (expected != actual)
+			printf("\t%-8s start 0x%08lx, expected 0x%08lx, got 0x%08lx\n", name, (unsigned long)before, (unsigned long)expected, (unsigned long)actual);
+	};
+
+	for (int i = 0; i < 32; i++)
+		diff(GetRegName(i), start.regs[i], ref.regs[i], g_state.regs[i]);
+	for (int i = 0; i < 32; i++)
+	{
+		char name[16];
+		snprintf(name, sizeof(name), "cop0r%d", i);
+		diff(name, start.cop0[i], ref.cop0[i], g_state.cop0[i]);
+	}
+	diff("pc", start.pc, ref.pc, g_state.pc);
+	diff("next_pc", start.next_pc, ref.next_pc, g_state.next_pc);
+	diff("hi", start.hi, ref.hi, g_state.hi);
+	diff("lo", start.lo, ref.lo, g_state.lo);
+	diff("cycles", start.cycles, ref.cycles, g_state.cycles);
+	diff("mdu", start.mdu_ready, ref.mdu_ready, g_state.mdu_ready);
+	diff("delay", ((uint64_t)start.delay.reg << 32) | start.delay.data, ((uint64_t)ref.delay.reg << 32) | ref.delay.data, ((uint64_t)load_delay_slot.reg << 32) | load_delay_slot.data);
+
+	uint8_t* ram = Bus::GetRAM(data_addr, data_size);
+	for (uint32_t i = 0; i < data_size; i++)
+	{
+		if (ram[i] != ref.mem[i])
+			printf("\t[0x%08x] start 0x%02x, expected 0x%02x, got 0x%02x\n", data_addr + i, start.mem[i], ref.mem[i], ram[i]);
+	}
+}
+
+int Fuzz::Run(uint32_t seed, int cases)
+{
+	using clock = std::chrono::steady_clock;
+
+	Generator gen(seed);
+	int failures = 0;
+	uint64_t instrs = 0;
+	clock::duration compile_time{}, run_time{}, ref_time{};
+
+	// Nothing chains out of a block, so each case runs exactly its own code
+	cycle_deadline = 0;
+
+	for (int c = 0; c < cases; c++)
+	{
+		bool branch;
+		std::vector<uint32_t> code = gen.Sequence(branch);
+		RefState start, ref;
+		gen.State(start);
+		ref = start;
+
+		// Left over code at a jal target could be inlined as a leaf, and run past the sequence
+		memset(Bus::GetRAM(code_addr, code_size), 0, code_size);
+		memcpy(Bus::GetRAM(code_addr, code.size() * 4), code.data(), code.size() * 4);
+		memcpy(Bus::GetRAM(data_addr, data_size), start.mem, data_size);
+		memcpy(g_state.regs, start.regs, sizeof(start.regs));
+		memcpy(g_state.cop0, start.cop0, sizeof(start.cop0));
+		g_state.pc = start.pc;
+		g_state.next_pc = start.next_pc;
+		g_state.hi = start.hi;
+		g_state.lo = start.lo;
+		g_state.cycles = start.cycles;
+		g_state.mdu_ready = start.mdu_ready;
+		load_delay_slot = start.delay;
+		next_load_delay = {0, 0};
+
+		// A branch ends the block after its delay slot, anything else after the last instruction
+		int max_instrs = branch ? code.size() - 1 : code.size();
+
+		auto t0 = clock::now();
+		HostFunc func = Bus::recomp->Compile(code_addr, max_instrs);
+		auto t1 = clock::now();
+		func();
+		auto t2 = clock::now();
+
+		for (size_t i = 0; i < code.size(); i++)
+			Step(ref, code[i], i);
+		ref.cycles += code.size();
+		auto t3 = clock::now();
+
+		compile_time += t1 - t0;
+		run_time += t2 - t1;
+		ref_time += t3 - t2;
+		instrs += code.size();
+
+		bool same = !memcmp(g_state.regs, ref.regs, sizeof(ref.regs)) && !memcmp(g_state.cop0, ref.cop0, sizeof(ref.cop0)) &&
+			g_state.pc == ref.pc && g_state.next_pc == ref.next_pc && g_state.hi == ref.hi && g_state.lo == ref.lo &&
+			g_state.cycles == ref.cycles && g_state.mdu_ready == ref.mdu_ready &&
+			load_delay_slot.reg == ref.delay.reg && load_delay_slot.data == ref.delay.data &&
+			!memcmp(Bus::GetRAM(data_addr, data_size), ref.mem, data_size);
+
+		if (!same && failures++ < max_reports)
+			Report(seed, c, code, start, ref);
+	}
+
+	auto per_sec = [](uint64_t n, clock::duration d)
+	{
+		return n / std::max(std::chrono::duration<double>(d).count(), 1e-9);
+	};
+
+	log("%d cases, %d failed (seed %u)\n", cases, failures, seed);
+	log("Compile: %.0f blocks/s, %.2f M guest instrs/s\n", per_sec(cases, compile_time), per_sec(instrs, compile_time) / 1e6);
+	log("Execute: %.2f M guest instrs/s compiled, %.2f M guest instrs/s interpreted\n", per_sec(instrs, run_time) / 1e6, per_sec(instrs, ref_time) / 1e6);
+
+	return failures;
+}
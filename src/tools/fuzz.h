@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstdint>
+
+// Runs random sequences of the instructions the recompiler supports through
+// both a compiled block and a plain interpreter, starting from the same state,
+// and reports any difference in registers, cop0, hi/lo, cycles or memory
+namespace Fuzz
+{
+	// Returns the number of sequences that didn't match
+	int Run(uint32_t seed, int cases);
+};